@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libopenmpt/libopenmpt.h>
+#include <opusenc.h>
+
+#include "modopus.h"
+
+/* Times the separate stages of a conversion:
+ * module load (create_mod), render only, and encode only on pre-rendered pcm.
+ * Every stage is reported as a realtime factor, audio seconds per wall clock second.
+ * Rendering at 48 kHz is then compared with rendering at another rate that
+ * libopusenc has to resample, as with --native-rate, and the float sample
+ * path with s16, including how far the s16 audio is from the float audio.
+ */
+
+static const int32_t framesizes[] = {
+  OPUS_FRAMESIZE_2_5_MS,
+  OPUS_FRAMESIZE_5_MS,
+  OPUS_FRAMESIZE_10_MS,
+  OPUS_FRAMESIZE_20_MS,
+  OPUS_FRAMESIZE_40_MS,
+  OPUS_FRAMESIZE_60_MS
+};
+static const char *framesize_names[] = {"2.5", "5", "10", "20", "40", "60"};
+static const int32_t interpolations[] = {0, 1, 2, 4, 8};
+
+#define NUM_FRAMESIZES (sizeof(framesizes) / sizeof(framesizes[0]))
+#define NUM_INTERPOLATIONS (sizeof(interpolations) / sizeof(interpolations[0]))
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name){
+  printf("Usage:\n");
+  printf("  %s <option(s)> <module(s)>\n", name);
+  printf("\nOptions:\n");
+  printf("  -s n  Render at most n seconds of each module. Default 60.\n");
+  printf("  -l n  Repeat the load n times. Default 5.\n");
+  printf("  -r n  Sample rate compared with 48 kHz. Default 44100.\n");
+}
+
+/* Renders up to limit frames of mod into a new buffer
+ * param frames set to the number of frames rendered
+ * return interleaved pcm in opt.sample_format, free after use
+ */
+static void *render(openmpt_module *mod, const modopus_settings opt, size_t limit, size_t *frames){
+  size_t frame = opt.channels * sample_bytes(opt);
+  unsigned char *pcm = malloc((limit + opt.buffersize) * frame);
+  if(pcm == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return NULL;
+  }
+  size_t total = 0;
+  while(total < limit){
+    size_t count = render_block(mod, opt, &pcm[total * frame]);
+    if(count == 0)
+      break;
+    total += count;
+  }
+  *frames = total;
+  return pcm;
+}
+
+// Encodes pcm in buffersize blocks, the output is thrown away
+static bool encode(const void *pcm, size_t frames, const modopus_settings opt){
+  size_t frame = opt.channels * sample_bytes(opt);
+  OggOpusComments *comm = ope_comments_create();
+  OggOpusEnc *enc = create_opus_encoder("/dev/null", opt, comm);
+  if(enc == NULL){
+    ope_comments_destroy(comm);
+    return false;
+  }
+  bool ok = true;
+  for(size_t pos = 0; pos < frames; pos += opt.buffersize){
+    size_t count = frames - pos < opt.buffersize ? frames - pos : opt.buffersize;
+    const void *block = (const unsigned char *)pcm + pos * frame;
+    int error = opt.sample_format == MODOPUS_S16 ? ope_encoder_write(enc, block, count) : ope_encoder_write_float(enc, block, count);
+    if(error != OPE_OK){
+      fprintf(stderr, "Failed writing opus data\n");
+      ok = false;
+      break;
+    }
+  }
+  ope_encoder_drain(enc);
+  ope_encoder_destroy(enc);
+  ope_comments_destroy(comm);
+  return ok;
+}
+
+/* Times render and encode together at the rate picked by calc_buffer
+ * return realtime factor, 0 on failure
+ */
+static double render_encode(const char *path, modopus_settings opt, double seconds){
+  calc_buffer(&opt);
+  openmpt_module *mod = create_mod(path, opt);
+  if(mod == NULL){
+    return 0;
+  }
+  size_t frames = 0;
+  double start = now();
+  void *pcm = render(mod, opt, (size_t)(seconds * opt.samplerate), &frames);
+  openmpt_module_destroy(mod);
+  if(pcm == NULL){
+    return 0;
+  }
+  bool ok = encode(pcm, frames, opt);
+  double elapsed = now() - start;
+  free(pcm);
+  return ok ? (double)frames / opt.samplerate / elapsed : 0;
+}
+
+// Compares rendering at 48 kHz with rendering at rate for every interpolation
+static void bench_rates(const char *path, double seconds, int32_t rate){
+  modopus_settings opt;
+  init_settings(&opt);
+  opt.quiet = true;
+  opt.input_rate = rate;
+  printf("%-6s %10d Hz %9d Hz %8s\n", "interp", rate, 48000, "speedup");
+  for(size_t i = 0; i < NUM_INTERPOLATIONS; i ++){
+    opt.interpolation = interpolations[i];
+    opt.native_rate = true;
+    double native = render_encode(path, opt, seconds);
+    opt.native_rate = false;
+    double direct = render_encode(path, opt, seconds);
+    if(native == 0 || direct == 0){
+      return;
+    }
+    printf("%-6d %11.1fx %11.1fx %7.2fx\n", interpolations[i], native, direct, direct / native);
+  }
+  printf("\n");
+}
+
+/* Renders path once as float and once as s16
+ * param snr set to the signal to noise ratio of the s16 audio in dB
+ * param exact set to the share of s16 samples equal to the rounded float sample
+ * return false on failure
+ */
+static bool compare_formats(const char *path, modopus_settings opt, double seconds, double *snr, double *exact){
+  float *pcm[2] = {NULL, NULL};
+  size_t frames[2] = {0, 0};
+  for(int i = 0; i < 2; i ++){
+    opt.sample_format = i == 0 ? MODOPUS_FLOAT : MODOPUS_S16;
+    openmpt_module *mod = create_mod(path, opt);
+    if(mod == NULL){
+      free(pcm[0]);
+      return false;
+    }
+    pcm[i] = render(mod, opt, (size_t)(seconds * opt.samplerate), &frames[i]);
+    openmpt_module_destroy(mod);
+  }
+  if(pcm[0] == NULL || pcm[1] == NULL){
+    free(pcm[0]);
+    free(pcm[1]);
+    return false;
+  }
+  const int16_t *s16 = (const int16_t *)pcm[1];
+  size_t samples = (frames[0] < frames[1] ? frames[0] : frames[1]) * opt.channels;
+  double signal = 0, noise = 0;
+  size_t same = 0;
+  for(size_t i = 0; i < samples; i ++){
+    double ref = pcm[0][i];
+    double diff = ref - s16[i] / 32768.0;
+    signal += ref * ref;
+    noise += diff * diff;
+    double rounded = round(ref * 32768);
+    rounded = rounded > 32767 ? 32767 : rounded < -32768 ? -32768 : rounded;
+    same += s16[i] == (int16_t)rounded;
+  }
+  *snr = noise > 0 ? 10 * log10(signal / noise) : INFINITY;
+  *exact = samples > 0 ? (double)same / samples : 1;
+  free(pcm[0]);
+  free(pcm[1]);
+  return true;
+}
+
+// Compares the float and s16 sample paths for every interpolation
+static void bench_formats(const char *path, double seconds){
+  modopus_settings opt;
+  init_settings(&opt);
+  opt.quiet = true;
+  printf("%-6s %11s %11s %8s %9s %8s\n", "interp", "float", "s16", "speedup", "snr", "exact");
+  for(size_t i = 0; i < NUM_INTERPOLATIONS; i ++){
+    opt.interpolation = interpolations[i];
+    opt.sample_format = MODOPUS_FLOAT;
+    double f32 = render_encode(path, opt, seconds);
+    opt.sample_format = MODOPUS_S16;
+    double s16 = render_encode(path, opt, seconds);
+    double snr = 0, exact = 0;
+    if(f32 == 0 || s16 == 0 || !compare_formats(path, opt, seconds, &snr, &exact)){
+      return;
+    }
+    printf("%-6d %10.1fx %10.1fx %7.2fx %6.1f dB %7.2f%%\n", interpolations[i], f32, s16, s16 / f32, snr, exact * 100);
+  }
+  printf("\n");
+}
+
+static void bench_module(const char *path, double seconds, int loads){
+  modopus_settings opt;
+  init_settings(&opt);
+  opt.quiet = true;
+
+  // Module load
+  double duration = 0;
+  double start = now();
+  for(int i = 0; i < loads; i ++){
+    openmpt_module *mod = create_mod(path, opt);
+    if(mod == NULL){
+      return;
+    }
+    duration = openmpt_module_get_duration_seconds(mod);
+    openmpt_module_destroy(mod);
+  }
+  double load = (now() - start) / loads;
+  printf("%s (%.1f s)\n", path, duration);
+  printf("load:   %8.3f ms %10.1fx realtime\n", load * 1000, duration / load);
+  printf("%-6s %-10s %12s %12s\n", "interp", "framesize", "render", "encode");
+
+  for(size_t i = 0; i < NUM_INTERPOLATIONS; i ++){
+    for(size_t f = 0; f < NUM_FRAMESIZES; f ++){
+      opt.interpolation = interpolations[i];
+      opt.framesize = framesizes[f];
+      calc_buffer(&opt);
+      openmpt_module *mod = create_mod(path, opt);
+      if(mod == NULL){
+        return;
+      }
+      size_t frames = 0;
+      start = now();
+      void *pcm = render(mod, opt, (size_t)(seconds * opt.samplerate), &frames);
+      double render_time = now() - start;
+      openmpt_module_destroy(mod);
+      if(pcm == NULL){
+        return;
+      }
+      start = now();
+      bool ok = encode(pcm, frames, opt);
+      double encode_time = now() - start;
+      free(pcm);
+      if(!ok){
+        return;
+      }
+      double audio = (double)frames / opt.samplerate;
+      printf("%-6d %-10s %11.1fx %11.1fx\n", interpolations[i], framesize_names[f],
+          audio / render_time, audio / encode_time);
+    }
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv){
+  double seconds = 60;
+  int loads = 5;
+  int32_t rate = 44100;
+  int c;
+  while((c = getopt(argc, argv, "hs:l:r:")) != -1){
+    switch(c){
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'l':
+        loads = atoi(optarg);
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+    }
+  }
+  if(optind >= argc || seconds <= 0 || loads < 1 || rate <= 0){
+    usage(argv[0]);
+    return 1;
+  }
+  for(int i = optind; i < argc; i ++){
+    bench_module(argv[i], seconds, loads);
+    bench_rates(argv[i], seconds, rate);
+    bench_formats(argv[i], seconds);
+  }
+  return 0;
+}
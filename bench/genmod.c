@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+/* Writes synthetic tracker modules for testing and benchmarking.
+ * The same options and seed always give the same file, so a corpus can
+ * be generated on the spot instead of being kept in the repository.
+ * Samples are looped saw and noise mixes, patterns are random notes
+ * with density controlling how many cells hold one.
+ */
+
+// Options of one module
+typedef struct{
+  const char *format;   // mod, xm or it
+  int channels;
+  int patterns;
+  int rows;
+  int samples;
+  uint32_t sample_len;  // frames per sample
+  double density;       // share of cells with a note, 0-1
+  uint32_t seed;
+}gen_options;
+
+// xorshift32, good enough for notes and noise
+static uint32_t next_random(uint32_t *state){
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static bool chance(uint32_t *state, double p){
+  return next_random(state) % 10000 < p * 10000;
+}
+
+static void put_u8(FILE *out, unsigned v){
+  fputc(v & 0xFF, out);
+}
+
+static void put_le16(FILE *out, unsigned v){
+  put_u8(out, v);
+  put_u8(out, v >> 8);
+}
+
+static void put_le32(FILE *out, uint32_t v){
+  put_le16(out, v & 0xFFFF);
+  put_le16(out, v >> 16);
+}
+
+static void put_be16(FILE *out, unsigned v){
+  put_u8(out, v >> 8);
+  put_u8(out, v);
+}
+
+// Writes s padded with zeros, or cut, to len bytes
+static void put_string(FILE *out, const char *s, size_t len){
+  size_t n = strlen(s);
+  for(size_t i = 0; i < len; i ++){
+    put_u8(out, i < n ? (unsigned char)s[i] : 0);
+  }
+}
+
+/* Signed 8 bit sample data. Each sample mixes a saw, whose period
+ * depends on the sample number, with a little noise.
+ */
+static int8_t *make_sample(const gen_options *opt, int index, uint32_t *state){
+  int8_t *data = malloc(opt->sample_len);
+  if(data == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return NULL;
+  }
+  uint32_t period = 32 + 8 * (index % 8);
+  for(uint32_t i = 0; i < opt->sample_len; i ++){
+    int saw = (int)(i % period) * 192 / (int)period - 96;
+    int noise = (int)(next_random(state) % 33) - 16;
+    data[i] = (int8_t)(saw + noise);
+  }
+  return data;
+}
+
+// ProTracker periods for C-1 to B-3
+static const unsigned mod_periods[36] = {
+  856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
+  428, 404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
+  214, 202, 190, 180, 170, 160, 151, 143, 135, 127, 120, 113
+};
+
+/* ProTracker MOD, M.K. for 4 channels, xCHN or xxCH above.
+ * Sample lengths are limited to 128 KiB by the format.
+ */
+static bool write_mod(FILE *out, gen_options opt){
+  uint32_t state = opt.seed;
+  if(opt.samples > 31){
+    opt.samples = 31;
+  }
+  if(opt.patterns > 64){
+    opt.patterns = 64;
+  }
+  if(opt.sample_len > 131070){
+    opt.sample_len = 131070;
+  }
+  opt.sample_len &= ~1u;
+  put_string(out, "modopus synthetic", 20);
+  for(int s = 0; s < 31; s ++){
+    bool used = s < opt.samples;
+    char name[23];
+    snprintf(name, sizeof(name), "sample %d", s + 1);
+    put_string(out, used ? name : "", 22);
+    put_be16(out, used ? opt.sample_len / 2 : 0);
+    put_u8(out, 0);              // finetune
+    put_u8(out, used ? 48 : 0);  // volume
+    put_be16(out, 0);            // loop start
+    put_be16(out, used ? opt.sample_len / 2 : 1);
+  }
+  put_u8(out, opt.patterns);
+  put_u8(out, 127);
+  for(int i = 0; i < 128; i ++){
+    put_u8(out, i < opt.patterns ? i : 0);
+  }
+  char tag[5];
+  if(opt.channels == 4)
+    strcpy(tag, "M.K.");
+  else if(opt.channels < 10)
+    snprintf(tag, sizeof(tag), "%dCHN", opt.channels);
+  else
+    snprintf(tag, sizeof(tag), "%dCH", opt.channels);
+  put_string(out, tag, 4);
+  for(int p = 0; p < opt.patterns; p ++){
+    for(int r = 0; r < 64; r ++){
+      for(int c = 0; c < opt.channels; c ++){
+        if(!chance(&state, opt.density)){
+          put_le32(out, 0);
+          continue;
+        }
+        unsigned sample = 1 + next_random(&state) % opt.samples;
+        unsigned period = mod_periods[next_random(&state) % 36];
+        put_u8(out, (sample & 0xF0) | (period >> 8));
+        put_u8(out, period);
+        put_u8(out, (sample & 0x0F) << 4);
+        put_u8(out, 0);
+      }
+    }
+  }
+  for(int s = 0; s < opt.samples; s ++){
+    int8_t *data = make_sample(&opt, s, &state);
+    if(data == NULL){
+      return false;
+    }
+    fwrite(data, 1, opt.sample_len, out);
+    free(data);
+  }
+  return true;
+}
+
+// Random note for XM and IT, kept within a few octaves around C-5
+static unsigned random_note(uint32_t *state){
+  return 36 + next_random(state) % 36;
+}
+
+/* FastTracker 2 XM with one instrument per sample.
+ * Cells are written with the packing flags, empty cells take one byte.
+ */
+static bool write_xm(FILE *out, gen_options opt){
+  uint32_t state = opt.seed;
+  if(opt.patterns > 256){
+    opt.patterns = 256;
+  }
+  if(opt.samples > 128){
+    opt.samples = 128;
+  }
+  put_string(out, "Extended Module: ", 17);
+  put_string(out, "modopus synthetic", 20);
+  put_u8(out, 0x1A);
+  put_string(out, "modopus-genmod", 20);
+  put_le16(out, 0x0104);
+  put_le32(out, 276);
+  put_le16(out, opt.patterns);  // song length
+  put_le16(out, 0);             // restart position
+  put_le16(out, opt.channels);
+  put_le16(out, opt.patterns);
+  put_le16(out, opt.samples);   // instruments
+  put_le16(out, 1);             // linear frequencies
+  put_le16(out, 6);             // speed
+  put_le16(out, 125);           // tempo
+  for(int i = 0; i < 256; i ++){
+    put_u8(out, i < opt.patterns ? i : 0);
+  }
+  for(int p = 0; p < opt.patterns; p ++){
+    // Packed size is only known afterwards, cells are built in memory first
+    size_t cap = (size_t)opt.rows * opt.channels * 5;
+    unsigned char *cells = malloc(cap);
+    if(cells == NULL){
+      fprintf(stderr, "Failed allocating memory\n");
+      return false;
+    }
+    size_t len = 0;
+    for(int r = 0; r < opt.rows; r ++){
+      for(int c = 0; c < opt.channels; c ++){
+        if(!chance(&state, opt.density)){
+          cells[len ++] = 0x80;
+          continue;
+        }
+        cells[len ++] = 0x83; // note and instrument follow
+        cells[len ++] = random_note(&state) + 1;
+        cells[len ++] = 1 + next_random(&state) % opt.samples;
+      }
+    }
+    put_le32(out, 9);
+    put_u8(out, 0);
+    put_le16(out, opt.rows);
+    put_le16(out, len);
+    fwrite(cells, 1, len, out);
+    free(cells);
+  }
+  for(int s = 0; s < opt.samples; s ++){
+    char name[23];
+    snprintf(name, sizeof(name), "instrument %d", s + 1);
+    put_le32(out, 263);
+    put_string(out, name, 22);
+    put_u8(out, 0);
+    put_le16(out, 1);                // samples in the instrument
+    put_le32(out, 40);               // sample header size
+    put_string(out, "", 96);         // every note plays sample 0
+    put_string(out, "", 48 + 48);    // envelopes
+    put_string(out, "", 2 + 3 + 3 + 2); // envelope points and flags
+    put_string(out, "", 4);          // vibrato
+    put_le16(out, 0x400);            // fadeout
+    put_string(out, "", 22);
+    // Sample header
+    put_le32(out, opt.sample_len);
+    put_le32(out, 0);
+    put_le32(out, opt.sample_len);   // loop length
+    put_u8(out, 48);                 // volume
+    put_u8(out, 0);                  // finetune
+    put_u8(out, 1);                  // forward loop, 8 bit
+    put_u8(out, 128);                // panning
+    put_u8(out, 0);                  // relative note
+    put_u8(out, 0);
+    snprintf(name, sizeof(name), "sample %d", s + 1);
+    put_string(out, name, 22);
+    // Sample data is stored as deltas
+    int8_t *data = make_sample(&opt, s, &state);
+    if(data == NULL){
+      return false;
+    }
+    int8_t last = 0;
+    for(uint32_t i = 0; i < opt.sample_len; i ++){
+      put_u8(out, (uint8_t)(data[i] - last));
+      last = data[i];
+    }
+    free(data);
+  }
+  return true;
+}
+
+/* Impulse Tracker IT in sample mode, without instruments.
+ * Offsets are known up front, as pattern sizes are computed first.
+ */
+static bool write_it(FILE *out, gen_options opt){
+  uint32_t state = opt.seed;
+  if(opt.channels > 64){
+    opt.channels = 64;
+  }
+  if(opt.patterns > 200){
+    opt.patterns = 200;
+  }
+  if(opt.samples > 99){
+    opt.samples = 99;
+  }
+  // Build the packed patterns first to know their sizes
+  unsigned char **packed = calloc(opt.patterns, sizeof(unsigned char *));
+  size_t *lens = calloc(opt.patterns, sizeof(size_t));
+  if(packed == NULL || lens == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    free(packed);
+    free(lens);
+    return false;
+  }
+  bool ok = true;
+  for(int p = 0; p < opt.patterns && ok; p ++){
+    packed[p] = malloc((size_t)opt.rows * (opt.channels * 4 + 1));
+    if(packed[p] == NULL){
+      fprintf(stderr, "Failed allocating memory\n");
+      ok = false;
+      break;
+    }
+    size_t len = 0;
+    for(int r = 0; r < opt.rows; r ++){
+      for(int c = 0; c < opt.channels; c ++){
+        if(!chance(&state, opt.density)){
+          continue;
+        }
+        packed[p][len ++] = (c + 1) | 0x80;
+        packed[p][len ++] = 0x03; // note and sample follow
+        packed[p][len ++] = random_note(&state) + 12;
+        packed[p][len ++] = 1 + next_random(&state) % opt.samples;
+      }
+      packed[p][len ++] = 0;
+    }
+    lens[p] = len;
+  }
+
+  uint32_t orders = opt.patterns + 1;
+  uint32_t offset = 192 + orders + 4 * (opt.samples + opt.patterns);
+  uint32_t sample_headers = offset;
+  offset += 80 * opt.samples;
+  uint32_t pattern_data = offset;
+  for(int p = 0; p < opt.patterns; p ++){
+    offset += 8 + lens[p];
+  }
+  uint32_t sample_data = offset;
+
+  if(ok){
+    put_string(out, "IMPM", 4);
+    put_string(out, "modopus synthetic", 26);
+    put_le16(out, 0x1004);
+    put_le16(out, orders);
+    put_le16(out, 0);              // instruments
+    put_le16(out, opt.samples);
+    put_le16(out, opt.patterns);
+    put_le16(out, 0x0214);         // created with
+    put_le16(out, 0x0214);         // compatible with
+    put_le16(out, 0x0009);         // stereo, linear slides
+    put_le16(out, 0);
+    put_u8(out, 128);              // global volume
+    put_u8(out, 48);               // mix volume
+    put_u8(out, 6);                // speed
+    put_u8(out, 125);              // tempo
+    put_u8(out, 128);              // separation
+    put_u8(out, 0);
+    put_le16(out, 0);              // message
+    put_le32(out, 0);
+    put_le32(out, 0);
+    for(int c = 0; c < 64; c ++){
+      put_u8(out, c < opt.channels ? (c % 2 ? 48 : 16) : 160);
+    }
+    for(int c = 0; c < 64; c ++){
+      put_u8(out, 64);
+    }
+    for(int p = 0; p < opt.patterns; p ++){
+      put_u8(out, p);
+    }
+    put_u8(out, 255);
+    for(int s = 0; s < opt.samples; s ++){
+      put_le32(out, sample_headers + 80 * s);
+    }
+    offset = pattern_data;
+    for(int p = 0; p < opt.patterns; p ++){
+      put_le32(out, offset);
+      offset += 8 + lens[p];
+    }
+    for(int s = 0; s < opt.samples; s ++){
+      char name[27];
+      snprintf(name, sizeof(name), "sample %d", s + 1);
+      put_string(out, "IMPS", 4);
+      put_string(out, "", 12);
+      put_u8(out, 0);
+      put_u8(out, 64);             // global volume
+      put_u8(out, 0x11);           // sample present, looped, 8 bit
+      put_u8(out, 48);             // volume
+      put_string(out, name, 26);
+      put_u8(out, 1);              // signed samples
+      put_u8(out, 32);
+      put_le32(out, opt.sample_len);
+      put_le32(out, 0);
+      put_le32(out, opt.sample_len);
+      put_le32(out, 8363);
+      put_le32(out, 0);
+      put_le32(out, 0);
+      put_le32(out, sample_data + opt.sample_len * s);
+      put_le32(out, 0);            // vibrato
+    }
+    for(int p = 0; p < opt.patterns; p ++){
+      put_le16(out, lens[p]);
+      put_le16(out, opt.rows);
+      put_le32(out, 0);
+      fwrite(packed[p], 1, lens[p], out);
+    }
+    for(int s = 0; s < opt.samples && ok; s ++){
+      int8_t *data = make_sample(&opt, s, &state);
+      if(data == NULL){
+        ok = false;
+        break;
+      }
+      fwrite(data, 1, opt.sample_len, out);
+      free(data);
+    }
+  }
+  for(int p = 0; p < opt.patterns; p ++){
+    free(packed[p]);
+  }
+  free(packed);
+  free(lens);
+  return ok;
+}
+
+static void usage(const char *name){
+  printf("Usage:\n");
+  printf("  %s <option(s)> <output file>\n", name);
+  printf("\nOptions:\n");
+  printf("  -f n  Format, one of [mod, xm, it]. Default mod.\n");
+  printf("  -c n  Channels. Default 4.\n");
+  printf("  -p n  Patterns, each played once. Default 4.\n");
+  printf("  -r n  Rows per pattern, xm and it only. Default 64.\n");
+  printf("  -n n  Samples. Default 8.\n");
+  printf("  -l n  Sample length in frames. Default 16384.\n");
+  printf("  -d n  Share of cells holding a note, 0 to 1. Default 0.5.\n");
+  printf("  -s n  Random seed. Default 1.\n");
+}
+
+int main(int argc, char **argv){
+  gen_options opt = {"mod", 4, 4, 64, 8, 16384, 0.5, 1};
+  int c;
+  while((c = getopt(argc, argv, "hf:c:p:r:n:l:d:s:")) != -1){
+    switch(c){
+      case 'f':
+        opt.format = optarg;
+        break;
+      case 'c':
+        opt.channels = atoi(optarg);
+        break;
+      case 'p':
+        opt.patterns = atoi(optarg);
+        break;
+      case 'r':
+        opt.rows = atoi(optarg);
+        break;
+      case 'n':
+        opt.samples = atoi(optarg);
+        break;
+      case 'l':
+        opt.sample_len = strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        opt.density = atof(optarg);
+        break;
+      case 's':
+        opt.seed = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+    }
+  }
+  if(optind != argc - 1 || opt.channels < 1 || opt.channels > 32 || opt.patterns < 1
+      || opt.rows < 1 || opt.rows > 256 || opt.samples < 1 || opt.sample_len < 2
+      || opt.density < 0 || opt.density > 1){
+    usage(argv[0]);
+    return 1;
+  }
+  // xorshift never leaves 0
+  if(opt.seed == 0){
+    opt.seed = 1;
+  }
+  bool (*writer)(FILE *, gen_options);
+  if(strcmp(opt.format, "mod") == 0)
+    writer = write_mod;
+  else if(strcmp(opt.format, "xm") == 0)
+    writer = write_xm;
+  else if(strcmp(opt.format, "it") == 0)
+    writer = write_it;
+  else{
+    usage(argv[0]);
+    return 1;
+  }
+  FILE *out = fopen(argv[optind], "wb");
+  if(out == NULL){
+    perror(argv[optind]);
+    return 1;
+  }
+  bool ok = writer(out, opt);
+  if(fclose(out) != 0 || !ok){
+    fprintf(stderr, "%s: failed writing module\n", argv[optind]);
+    return 1;
+  }
+  return 0;
+}
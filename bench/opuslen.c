@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Prints the decoded length of Ogg Opus files in 48 kHz samples,
+ * the granule position of the last page minus the pre-skip.
+ * Only the page headers are read, no decoder is needed.
+ * Chained files report the sum of their links.
+ */
+
+static uint64_t read_le(const unsigned char *p, int bytes){
+  uint64_t v = 0;
+  for(int i = bytes - 1; i >= 0; i --){
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+/* Walks the pages of one file
+ * param samples set to the decoded length
+ * return false if the file is not a valid Ogg Opus stream
+ */
+static bool opus_length(FILE *in, uint64_t *samples){
+  unsigned char header[27];
+  unsigned char lacing[255];
+  unsigned char packet[19];
+  uint64_t total = 0;
+  uint64_t granule = 0;
+  uint32_t preskip = 0;
+  bool open = false;
+  while(fread(header, 1, 27, in) == 27){
+    if(memcmp(header, "OggS", 4) != 0){
+      return false;
+    }
+    int segments = header[26];
+    if(fread(lacing, 1, segments, in) != (size_t)segments){
+      return false;
+    }
+    long body = 0;
+    for(int i = 0; i < segments; i ++){
+      body += lacing[i];
+    }
+    // Beginning of a stream, the first packet is OpusHead
+    if(header[5] & 0x02){
+      if(body < 19 || fread(packet, 1, 19, in) != 19 || memcmp(packet, "OpusHead", 8) != 0){
+        return false;
+      }
+      body -= 19;
+      if(open){
+        total += granule - preskip;
+      }
+      preskip = read_le(&packet[10], 2);
+      granule = preskip;
+      open = true;
+    }
+    uint64_t page_granule = read_le(&header[6], 8);
+    if(page_granule != UINT64_MAX && open){
+      granule = page_granule;
+    }
+    if(fseek(in, body, SEEK_CUR) != 0){
+      return false;
+    }
+  }
+  if(!open){
+    return false;
+  }
+  *samples = total + granule - preskip;
+  return true;
+}
+
+int main(int argc, char **argv){
+  if(argc < 2){
+    printf("Usage:\n");
+    printf("  %s <opus file(s)>\n", argv[0]);
+    return 1;
+  }
+  int ret = 0;
+  for(int i = 1; i < argc; i ++){
+    FILE *in = fopen(argv[i], "rb");
+    if(in == NULL){
+      perror(argv[i]);
+      ret = 1;
+      continue;
+    }
+    uint64_t samples = 0;
+    if(opus_length(in, &samples)){
+      printf("%llu %s\n", (unsigned long long)samples, argv[i]);
+    }
+    else{
+      fprintf(stderr, "%s: not an Ogg Opus file\n", argv[i]);
+      ret = 1;
+    }
+    fclose(in);
+  }
+  return ret;
+}
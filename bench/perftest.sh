@@ -0,0 +1,145 @@
+#!/bin/sh
+# Converts a generated corpus of modules and checks the results, see make perftest.
+#
+# - every output matches the checksum stored in bench/perftest.sums
+# - parallel (-j) and --pipeline runs give the same bytes as a serial run
+# - every output decodes to exactly the number of frames that were rendered
+# - the serial run is at least PERFTEST_TOLERANCE times as fast as the
+#   realtime factor stored in bench/perftest.baseline
+#
+# Checksums and baseline depend on the machine and the library versions, so
+# they aren't shipped. make perftest-baseline records them, which sets
+# PERFTEST_RECORD=1. Without them the test fails rather than passing
+# against numbers it just made up.
+
+BINDIR=${BINDIR:-bin}
+WORKDIR=${WORKDIR:-build/perftest}
+SUMS=${PERFTEST_SUMS:-bench/perftest.sums}
+BASELINE=${PERFTEST_BASELINE:-bench/perftest.baseline}
+TOLERANCE=${PERFTEST_TOLERANCE:-0.8}
+JOBS=${PERFTEST_JOBS:-4}
+RECORD=${PERFTEST_RECORD:-0}
+
+MODOPUS=$BINDIR/modopus
+GENMOD=$BINDIR/modopus-genmod
+OPUSLEN=$BINDIR/modopus-opuslen
+
+failed=0
+fail(){
+  echo "FAIL: $*"
+  failed=1
+}
+
+# name format and generator options, one module per line
+corpus(){
+  cat <<EOF
+mod4 mod -c 4 -p 8 -n 8 -l 8192 -d 0.5 -s 1
+mod8 mod -c 8 -p 6 -n 16 -l 32768 -d 0.8 -s 2
+mod16-sparse mod -c 16 -p 4 -n 31 -l 4096 -d 0.1 -s 3
+xm12 xm -c 12 -p 4 -r 64 -n 16 -l 16384 -d 0.6 -s 4
+xm32-dense xm -c 32 -p 2 -r 128 -n 24 -l 65536 -d 0.9 -s 5
+it8 it -c 8 -p 6 -r 64 -n 8 -l 16384 -d 0.4 -s 6
+it24 it -c 24 -p 3 -r 96 -n 32 -l 8192 -d 0.7 -s 7
+EOF
+}
+
+for f in "$MODOPUS" "$GENMOD" "$OPUSLEN"; do
+  if [ ! -x "$f" ]; then
+    echo "$f not found, run make perftest instead"
+    exit 1
+  fi
+done
+if [ "$RECORD" -eq 0 ]; then
+  for f in "$SUMS" "$BASELINE"; do
+    if [ ! -f "$f" ]; then
+      echo "FAIL: $f not found, run make perftest-baseline to record it"
+      exit 1
+    fi
+  done
+fi
+
+rm -rf "$WORKDIR"
+mkdir -p "$WORKDIR/corpus" "$WORKDIR/serial" "$WORKDIR/parallel" "$WORKDIR/pipeline"
+corpus | while read -r name format args; do
+  # shellcheck disable=SC2086
+  "$GENMOD" -f "$format" $args "$WORKDIR/corpus/$name.$format" || exit 1
+done || { echo "FAIL: generating the corpus"; exit 1; }
+
+# convert <output directory> <options>
+convert(){
+  out=$1
+  shift
+  "$MODOPUS" -q --serialno 1 --stats json --stats-file "$WORKDIR/$(basename "$out").json" \
+    -o "$out" "$@" "$WORKDIR"/corpus/* || fail "modopus exited with an error ($*)"
+}
+
+convert "$WORKDIR/serial"
+convert "$WORKDIR/parallel" -j "$JOBS"
+convert "$WORKDIR/pipeline" --pipeline
+
+# Checksums of the serial run, keyed by file name
+(cd "$WORKDIR/serial" && sha256sum -- *.opus) > "$WORKDIR/sums"
+for run in parallel pipeline; do
+  (cd "$WORKDIR/$run" && sha256sum -- *.opus) | cmp -s - "$WORKDIR/sums" ||
+    fail "$run output differs from the serial output"
+done
+if [ "$RECORD" -ne 0 ]; then
+  cp "$WORKDIR/sums" "$SUMS"
+  echo "Recorded checksums in $SUMS"
+else
+  cmp -s "$SUMS" "$WORKDIR/sums" || {
+    fail "checksums differ from $SUMS"
+    diff "$SUMS" "$WORKDIR/sums"
+  }
+fi
+
+# Decoded length against rendered frames. Rendering is at 48 kHz, the
+# rate Opus decodes at, so the two must be equal.
+grep -v '"summary"' "$WORKDIR/serial.json" | awk -F'"' '
+  {
+    status = ""; frames = ""
+    for(i = 1; i < NF; i ++){
+      if($i == "file") file = $(i + 2)
+      if($i == "status") status = $(i + 2)
+      if($i == "frames") { frames = $(i + 1); sub(/^:/, "", frames); sub(/,.*/, "", frames) }
+    }
+    n = split(file, parts, "/")
+    base = parts[n]
+    sub(/\.[^.]*$/, "", base)
+    print base, status, frames
+  }' > "$WORKDIR/frames"
+[ "$(wc -l < "$WORKDIR/frames")" -eq "$(corpus | wc -l)" ] || fail "missing stats for some files"
+while read -r name status frames; do
+  if [ "$status" != "ok" ]; then
+    fail "$name: conversion failed"
+    continue
+  fi
+  samples=$("$OPUSLEN" "$WORKDIR/serial/$name.opus" | cut -d' ' -f1)
+  if [ "$samples" != "$frames" ]; then
+    fail "$name: decodes to ${samples:-no} samples, rendered $frames"
+  fi
+  if [ "$frames" -eq 0 ]; then
+    fail "$name: nothing was rendered"
+  fi
+done < "$WORKDIR/frames"
+
+# Throughput of the serial run
+rtf=$(grep '"summary"' "$WORKDIR/serial.json" | sed 's/.*"realtime_factor":\([0-9.]*\).*/\1/')
+if [ -z "$rtf" ]; then
+  fail "no summary in $WORKDIR/serial.json"
+elif [ "$RECORD" -ne 0 ]; then
+  echo "$rtf" > "$BASELINE"
+  echo "Recorded realtime factor ${rtf}x in $BASELINE"
+else
+  base=$(cat "$BASELINE")
+  if awk -v rtf="$rtf" -v base="$base" -v tol="$TOLERANCE" 'BEGIN{ exit !(rtf < base * tol) }'; then
+    fail "realtime factor ${rtf}x is below $TOLERANCE of the ${base}x baseline"
+  else
+    echo "Realtime factor ${rtf}x, baseline ${base}x"
+  fi
+fi
+
+if [ "$failed" -ne 0 ]; then
+  exit 1
+fi
+echo "perftest passed"
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <zlib.h>
+
+#include "modopus.h"
+#include "archive.h"
+
+/* Tar and zip archives as input, so module packs don't have to be
+ * extracted first. The archive is mapped into memory, stored members are
+ * handed to libopenmpt straight from the mapping and deflated zip members
+ * are inflated into memory one at a time.
+ * Only modules are listed, other members such as readme files are skipped.
+ */
+
+#define TAR_BLOCK 512
+// Deflate can't expand data by more than about 1032 to 1
+#define ZIP_MAX_RATIO 1032
+
+// Checks the extension, .tar and .zip in any case
+bool is_archive(const char *path){
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  if(dot == NULL || (slash != NULL && dot < slash)){
+    return false;
+  }
+  return strcasecmp(dot, ".tar") == 0 || strcasecmp(dot, ".zip") == 0;
+}
+
+static uint64_t read_le(const unsigned char *p, int bytes){
+  uint64_t v = 0;
+  for(int i = bytes - 1; i >= 0; i --){
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+// Names that would end up outside the output directory are refused
+static bool safe_name(const char *name){
+  if(name[0] == '/'){
+    return false;
+  }
+  for(const char *p = name; *p != '\0'; p ++){
+    if(p[0] == '.' && p[1] == '.' && (p == name || p[-1] == '/') && (p[2] == '/' || p[2] == '\0')){
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Adds a member if it is a module.
+ * param name path inside the archive, taken over by the archive
+ * return false if memory ran out
+ */
+static bool add_member(modopus_archive *archive, char *name, uint64_t offset, uint64_t size, uint64_t packed, uint32_t crc, int method){
+  // tar cf x.tar . names everything ./name
+  while(strncmp(name, "./", 2) == 0){
+    memmove(name, &name[2], strlen(name) - 1);
+  }
+  size_t len = strlen(name);
+  if(len == 0 || name[len - 1] == '/' || size == 0 || !has_module_extension(name)){
+    free(name);
+    return true;
+  }
+  if(!safe_name(name)){
+    fprintf(stderr, "%s: skipping %s, it points outside the archive\n", archive->path, name);
+    free(name);
+    return true;
+  }
+  archive_member *members = realloc(archive->members, (archive->count + 1) * sizeof(archive_member));
+  char *path = malloc(strlen(archive->path) + len + 2);
+  if(members == NULL || path == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    if(members != NULL){
+      archive->members = members;
+    }
+    free(path);
+    free(name);
+    return false;
+  }
+  sprintf(path, "%s/%s", archive->path, name);
+  archive->members = members;
+  archive->members[archive->count ++] = (archive_member){name, path, offset, size, packed, crc, method};
+  return true;
+}
+
+// Octal number field, or base-256 with the top bit set for large sizes
+static uint64_t tar_number(const unsigned char *field, size_t len){
+  uint64_t v = 0;
+  if(field[0] & 0x80){
+    v = field[0] & 0x7F;
+    for(size_t i = 1; i < len; i ++){
+      v = v << 8 | field[i];
+    }
+    return v;
+  }
+  size_t i = 0;
+  while(i < len && field[i] == ' '){
+    i ++;
+  }
+  for(; i < len && field[i] >= '0' && field[i] <= '7'; i ++){
+    v = v * 8 + field[i] - '0';
+  }
+  return v;
+}
+
+// The header checksum counts its own field as spaces
+static bool tar_checksum(const unsigned char *header){
+  uint64_t sum = 0;
+  for(int i = 0; i < TAR_BLOCK; i ++){
+    sum += i >= 148 && i < 156 ? ' ' : header[i];
+  }
+  return sum == tar_number(&header[148], 8);
+}
+
+// Name of a plain ustar header, with the prefix field for long paths
+static char *tar_name(const unsigned char *header){
+  char name[256 + 1] = "";
+  if(memcmp(&header[257], "ustar", 5) == 0 && header[345] != '\0'){
+    strncat(name, (const char *)&header[345], 155);
+    strcat(name, "/");
+  }
+  strncat(name, (const char *)header, 100);
+  return strdup(name);
+}
+
+// Finds the path record of a pax extended header, records are "len key=value\n"
+static char *pax_path(const unsigned char *data, uint64_t len){
+  uint64_t pos = 0;
+  while(pos < len){
+    uint64_t reclen = 0;
+    uint64_t i = pos;
+    while(i < len && data[i] >= '0' && data[i] <= '9'){
+      reclen = reclen * 10 + data[i ++] - '0';
+    }
+    if(reclen == 0 || pos + reclen > len || i >= len || data[i] != ' '){
+      return NULL;
+    }
+    const char *record = (const char *)&data[i + 1];
+    size_t rest = pos + reclen - (i + 1);
+    if(rest > 6 && memcmp(record, "path=", 5) == 0){
+      return strndup(&record[5], rest - 6);
+    }
+    pos += reclen;
+  }
+  return NULL;
+}
+
+/* Lists the regular files of a tar archive. GNU long names and pax path
+ * records replace the name of the header that follows them.
+ */
+static bool tar_list(modopus_archive *archive){
+  const unsigned char *data = archive->file.data;
+  uint64_t size = archive->file.size;
+  uint64_t pos = 0;
+  char *longname = NULL;
+  bool ok = true;
+  if(size % TAR_BLOCK != 0){
+    fprintf(stderr, "%s: not a tar archive\n", archive->path);
+    return false;
+  }
+  while(ok && pos + TAR_BLOCK <= size){
+    const unsigned char *header = &data[pos];
+    if(header[0] == '\0'){
+      break; // end of archive
+    }
+    if(!tar_checksum(header)){
+      fprintf(stderr, "%s: damaged tar header at %llu\n", archive->path, (unsigned long long)pos);
+      ok = false;
+      break;
+    }
+    uint64_t len = tar_number(&header[124], 12);
+    uint64_t body = pos + TAR_BLOCK;
+    if(len > size - body){
+      fprintf(stderr, "%s: truncated tar archive\n", archive->path);
+      ok = false;
+      break;
+    }
+    char type = header[156];
+    if(type == 'L' || type == 'x'){
+      free(longname);
+      longname = type == 'L' ? strndup((const char *)&data[body], len) : pax_path(&data[body], len);
+    }
+    else{
+      if(type == '0' || type == '\0' || type == '7'){
+        char *name = longname != NULL ? longname : tar_name(header);
+        longname = NULL;
+        ok = name != NULL && add_member(archive, name, body, len, len, 0, ARCHIVE_STORED);
+      }
+      free(longname);
+      longname = NULL;
+    }
+    pos = body + (len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+  }
+  free(longname);
+  return ok;
+}
+
+/* Finds the central directory through the end of central directory
+ * record, or its zip64 version for archives over 4 GiB.
+ */
+static bool zip_directory(const modopus_archive *archive, uint64_t *offset, uint64_t *entries){
+  const unsigned char *data = archive->file.data;
+  uint64_t size = archive->file.size;
+  if(size < 22){
+    return false;
+  }
+  // The record is followed by a comment of up to 65535 bytes
+  uint64_t end = size - 22;
+  uint64_t stop = end > 65535 ? end - 65535 : 0;
+  for(uint64_t pos = end + 1; pos -- > stop;){
+    if(read_le(&data[pos], 4) != 0x06054b50){
+      continue;
+    }
+    *entries = read_le(&data[pos + 10], 2);
+    *offset = read_le(&data[pos + 16], 4);
+    if((*entries == 0xFFFF || *offset == 0xFFFFFFFF) && pos >= 20 && read_le(&data[pos - 20], 4) == 0x07064b50){
+      uint64_t zip64 = read_le(&data[pos - 12], 8);
+      if(zip64 + 56 > size || read_le(&data[zip64], 4) != 0x06064b50){
+        return false;
+      }
+      *entries = read_le(&data[zip64 + 32], 8);
+      *offset = read_le(&data[zip64 + 48], 8);
+    }
+    return *offset < size;
+  }
+  return false;
+}
+
+// Sizes and offset that didn't fit into 32 bits are in the zip64 extra field
+static void zip64_extra(const unsigned char *extra, uint64_t len, uint64_t *size, uint64_t *packed, uint64_t *local){
+  uint64_t pos = 0;
+  while(pos + 4 <= len){
+    uint64_t id = read_le(&extra[pos], 2);
+    uint64_t field = read_le(&extra[pos + 2], 2);
+    if(pos + 4 + field > len){
+      return;
+    }
+    if(id == 0x0001){
+      const unsigned char *p = &extra[pos + 4];
+      const unsigned char *fend = p + field;
+      uint64_t *values[] = {size, packed, local};
+      for(int i = 0; i < 3; i ++){
+        if(*values[i] == 0xFFFFFFFF && p + 8 <= fend){
+          *values[i] = read_le(p, 8);
+          p += 8;
+        }
+      }
+      return;
+    }
+    pos += 4 + field;
+  }
+}
+
+/* Lists the members of a zip archive from its central directory.
+ * Encrypted members and compression methods other than deflate are skipped.
+ */
+static bool zip_list(modopus_archive *archive){
+  const unsigned char *data = archive->file.data;
+  uint64_t size = archive->file.size;
+  uint64_t pos, entries;
+  if(!zip_directory(archive, &pos, &entries)){
+    fprintf(stderr, "%s: not a zip archive\n", archive->path);
+    return false;
+  }
+  for(uint64_t i = 0; i < entries; i ++){
+    if(pos + 46 > size || read_le(&data[pos], 4) != 0x02014b50){
+      fprintf(stderr, "%s: damaged zip directory\n", archive->path);
+      return false;
+    }
+    const unsigned char *entry = &data[pos];
+    uint64_t flags = read_le(&entry[8], 2);
+    uint64_t method = read_le(&entry[10], 2);
+    uint32_t crc = read_le(&entry[16], 4);
+    uint64_t packed = read_le(&entry[20], 4);
+    uint64_t extracted = read_le(&entry[24], 4);
+    uint64_t namelen = read_le(&entry[28], 2);
+    uint64_t extralen = read_le(&entry[30], 2);
+    uint64_t commentlen = read_le(&entry[32], 2);
+    uint64_t local = read_le(&entry[42], 4);
+    if(pos + 46 + namelen + extralen > size){
+      fprintf(stderr, "%s: damaged zip directory\n", archive->path);
+      return false;
+    }
+    zip64_extra(&entry[46 + namelen], extralen, &extracted, &packed, &local);
+    char *name = strndup((const char *)&entry[46], namelen);
+    if(name == NULL){
+      fprintf(stderr, "Failed allocating memory\n");
+      return false;
+    }
+    pos += 46 + namelen + extralen + commentlen;
+    if((flags & 1) || (method != 0 && method != 8)){
+      if(has_module_extension(name)){
+        fprintf(stderr, "%s: skipping %s, it is encrypted or uses an unsupported compression\n", archive->path, name);
+      }
+      free(name);
+      continue;
+    }
+    // Data starts after the local header, whose name and extra field may differ
+    if(local + 30 > size || read_le(&data[local], 4) != 0x04034b50){
+      fprintf(stderr, "%s: damaged zip member %s\n", archive->path, name);
+      free(name);
+      continue;
+    }
+    uint64_t offset = local + 30 + read_le(&data[local + 26], 2) + read_le(&data[local + 28], 2);
+    if(offset > size || packed > size - offset){
+      fprintf(stderr, "%s: truncated zip member %s\n", archive->path, name);
+      free(name);
+      continue;
+    }
+    // Stored members are handed out straight from the mapping, and a
+    // directory claiming more than deflate can produce isn't trusted
+    if((method == 0 && extracted != packed) || (method == 8 && extracted / ZIP_MAX_RATIO > packed)){
+      fprintf(stderr, "%s: damaged zip member %s\n", archive->path, name);
+      free(name);
+      continue;
+    }
+    if(!add_member(archive, name, offset, extracted, packed, crc, method == 8 ? ARCHIVE_DEFLATED : ARCHIVE_STORED)){
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Maps an archive and lists the modules in it.
+ * param path path to a .tar or .zip file
+ * param archive set to the archive, release with archive_close
+ * return false if the archive could not be read
+ */
+bool archive_open(const char *path, modopus_archive *archive){
+  archive->path = path;
+  archive->members = NULL;
+  archive->count = 0;
+  if(!map_file(path, &archive->file)){
+    return false;
+  }
+  const unsigned char *data = archive->file.data;
+  bool zip = archive->file.size >= 4 && read_le(data, 4) == 0x04034b50;
+  // An empty zip starts right with its end record
+  zip |= archive->file.size >= 4 && read_le(data, 4) == 0x06054b50;
+  if(!(zip ? zip_list(archive) : tar_list(archive))){
+    archive_close(archive);
+    return false;
+  }
+  return true;
+}
+
+/* Gives the contents of a member.
+ * Stored members point into the mapped archive, deflated members are
+ * inflated into a new buffer and checked against their CRC-32.
+ * param file set to the contents, release with archive_release
+ * return false if the member could not be extracted
+ */
+bool archive_read(const modopus_archive *archive, size_t index, modopus_file *file){
+  const archive_member *member = &archive->members[index];
+  const unsigned char *data = archive->file.data;
+  file->mapped = false;
+  if(member->method == ARCHIVE_STORED){
+    if(member->size > archive->file.size - member->offset){
+      fprintf(stderr, "%s: truncated member\n", member->path);
+      return false;
+    }
+    file->data = (void *)&data[member->offset];
+    file->size = member->size;
+    return true;
+  }
+  if(member->size > UINT_MAX || member->packed > UINT_MAX){
+    fprintf(stderr, "%s: member is too large\n", member->path);
+    return false;
+  }
+  unsigned char *out = malloc(member->size);
+  if(out == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return false;
+  }
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // Zip members are raw deflate without a zlib header
+  if(inflateInit2(&zs, -MAX_WBITS) != Z_OK){
+    fprintf(stderr, "%s: failed setting up zlib\n", member->path);
+    free(out);
+    return false;
+  }
+  zs.next_in = (Bytef *)&data[member->offset];
+  zs.avail_in = member->packed;
+  zs.next_out = out;
+  zs.avail_out = member->size;
+  int error = inflate(&zs, Z_FINISH);
+  inflateEnd(&zs);
+  if(error != Z_STREAM_END || zs.total_out != member->size
+      || crc32(crc32(0, NULL, 0), out, member->size) != member->crc){
+    fprintf(stderr, "%s: damaged zip member\n", member->path);
+    free(out);
+    return false;
+  }
+  file->data = out;
+  file->size = member->size;
+  return true;
+}
+
+// Frees a member from archive_read, views into the mapping are left alone
+void archive_release(const modopus_archive *archive, modopus_file *file){
+  const unsigned char *start = archive->file.data;
+  const unsigned char *p = file->data;
+  if(p != NULL && (p < start || p >= start + archive->file.size)){
+    free(file->data);
+  }
+  file->data = NULL;
+  file->size = 0;
+}
+
+// Starts reading a member in the background, so it is cached when its turn comes
+void archive_prefetch(const modopus_archive *archive, size_t index){
+  if(!archive->file.mapped){
+    return;
+  }
+  const archive_member *member = &archive->members[index];
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)archive->file.data + member->offset;
+  uintptr_t aligned = start & ~(page - 1);
+  madvise((void *)aligned, start - aligned + member->packed, MADV_WILLNEED);
+}
+
+void archive_close(modopus_archive *archive){
+  for(size_t i = 0; i < archive->count; i ++){
+    free(archive->members[i].name);
+    free(archive->members[i].path);
+  }
+  free(archive->members);
+  archive->members = NULL;
+  archive->count = 0;
+  unmap_file(&archive->file);
+}
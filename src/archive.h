@@ -0,0 +1,39 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mapfile.h"
+
+// How a member is stored
+enum{
+  ARCHIVE_STORED,
+  ARCHIVE_DEFLATED
+};
+
+// A module inside an archive
+typedef struct{
+  char *name;      // path inside the archive
+  char *path;      // archive path followed by name, for messages and stats
+  uint64_t offset; // start of the member data in the archive
+  uint64_t size;   // size once extracted
+  uint64_t packed; // size in the archive
+  uint32_t crc;    // CRC-32 of a zip member
+  int method;
+}archive_member;
+
+// A tar or zip file mapped into memory, with the modules inside it
+typedef struct{
+  const char *path;
+  modopus_file file;
+  archive_member *members;
+  size_t count;
+}modopus_archive;
+
+bool is_archive(const char *);
+bool archive_open(const char *, modopus_archive *);
+bool archive_read(const modopus_archive *, size_t, modopus_file *);
+void archive_release(const modopus_archive *, modopus_file *);
+void archive_prefetch(const modopus_archive *, size_t);
+void archive_close(modopus_archive *);
+#endif
@@ -0,0 +1,1104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <libopenmpt/libopenmpt.h>
+#include <opusenc.h>
+
+#include "modopus.h"
+#include "split_path.h"
+#include "batch.h"
+#include "mapfile.h"
+#include "cache.h"
+#include "stats.h"
+#include "pcmcache.h"
+#include "loudness.h"
+#include "segment.h"
+
+/* Output path for an input, inside the -o directory if one was given.
+ * When streaming, every input shares the -o path.
+ */
+static char *make_outpath(char **split, const modopus_settings opt){
+  if(opt.output_stream != NULL){
+    return strdup(opt.filename);
+  }
+  char *name = parse_filename(split);
+  char *outpath = join_path(opt.filename, name);
+  free(name);
+  return outpath;
+}
+
+// Console output moves to stderr when stdout carries the opus stream
+static FILE *console(const modopus_settings opt){
+  return opt.output_stream == stdout ? stderr : stdout;
+}
+
+// A module ready for conversion, with its pcm cache entry if there is one
+typedef struct{
+  openmpt_module *mod;
+  openmpt_module_ext *ext;  // owner of mod when rendering a single channel
+  const modopus_file *file; // contents of the module when not read from its path
+  char *pcm_path;   // NULL without --pcm-cache
+  pcm_entry cached;
+  bool pcm_hit;
+}loaded_module;
+
+static void unload_module(loaded_module *lm){
+  if(lm->ext != NULL){
+    openmpt_module_ext_destroy(lm->ext);
+  }
+  else if(lm->mod != NULL){
+    openmpt_module_destroy(lm->mod);
+  }
+  if(lm->pcm_hit){
+    pcm_cache_close(&lm->cached);
+  }
+  free(lm->pcm_path);
+  lm->mod = NULL;
+  lm->ext = NULL;
+  lm->pcm_path = NULL;
+  lm->pcm_hit = false;
+}
+
+/* Loads a module and selects opt.subsong, looking up its rendered audio
+ * in the pcm cache first. With opt.channel set only that channel is
+ * rendered, and file must be given.
+ * param file contents of filepath if already in memory, NULL to map it
+ * return false if the module could not be loaded
+ */
+static bool load_module(loaded_module *lm, const char *filepath, const modopus_file *file, const modopus_settings opt){
+  lm->mod = NULL;
+  lm->ext = NULL;
+  lm->file = file;
+  lm->pcm_path = NULL;
+  lm->pcm_hit = false;
+  // Cached audio is float and the whole mix, s16 and stems always render
+  if(opt.pcm_cache != NULL && !opt.dry_run && opt.sample_format == MODOPUS_FLOAT && opt.channel < 0){
+    uint64_t hash, size;
+    bool hashed = true;
+    if(file != NULL){
+      hash = hash_bytes(0, file->data, file->size);
+    }
+    else{
+      hashed = hash_file(filepath, &hash, &size);
+    }
+    lm->pcm_path = hashed ? pcm_cache_path(opt.pcm_cache, hash, opt) : NULL;
+    lm->pcm_hit = lm->pcm_path != NULL && pcm_cache_open(lm->pcm_path, opt, &lm->cached);
+  }
+  // Cached audio only needs the metadata, samples aren't loaded
+  if(lm->pcm_hit){
+    lm->mod = file != NULL ? probe_mod_memory(file->data, file->size) : probe_mod(filepath);
+  }
+  else if(opt.channel >= 0){
+    lm->ext = create_stem_from_memory(file->data, file->size, filepath, opt.channel, opt);
+    lm->mod = lm->ext != NULL ? openmpt_module_ext_get_module(lm->ext) : NULL;
+  }
+  else if(file != NULL){
+    lm->mod = create_mod_from_memory(file->data, file->size, filepath, opt);
+  }
+  else{
+    lm->mod = create_mod(filepath, opt);
+  }
+  if(lm->mod != NULL && opt.subsong >= 0 && !openmpt_module_select_subsong(lm->mod, opt.subsong)){
+    fprintf(stderr, "%s: failed selecting subsong %d\n", filepath, opt.subsong);
+    unload_module(lm);
+    return false;
+  }
+  if(lm->mod == NULL){
+    unload_module(lm);
+    return false;
+  }
+  return true;
+}
+
+/* Measures the loudness of a module for --normalize and sets the output
+ * gain that brings it to the target. The R128_TRACK_GAIN tag is relative
+ * to that gain and the -23 LUFS reference, as in RFC 7845.
+ */
+static void normalize_loudness(loaded_module *lm, const char *filepath, modopus_settings *opt, OggOpusComments *comm, FILE *out){
+  double lufs;
+  if(lm->pcm_hit){
+    lufs = measure_pcm_loudness(lm->cached.pcm, lm->cached.frames, *opt);
+  }
+  else{
+    lufs = measure_loudness(filepath, lm->file, *opt);
+  }
+  if(!isfinite(lufs)){
+    fprintf(stderr, "%s: loudness could not be measured, not normalizing\n", filepath);
+    return;
+  }
+  long gain = lround((opt->normalize - lufs) * 256);
+  gain = gain < INT16_MIN ? INT16_MIN : gain > INT16_MAX ? INT16_MAX : gain;
+  opt->header_gain = (int32_t)gain;
+  long track = lround((-23 - (lufs + gain / 256.0)) * 256);
+  track = track < INT16_MIN ? INT16_MIN : track > INT16_MAX ? INT16_MAX : track;
+  char tag[16];
+  snprintf(tag, sizeof(tag), "%ld", track);
+  ope_comments_add(comm, "R128_TRACK_GAIN", tag);
+  if(!opt->quiet){
+    fprintf(out, "Loudness:       %.1f LUFS, output gain %+.2f dB\n\n", lufs, gain / 256.0);
+  }
+}
+
+/* Moves src to the start of a --start/--duration clip, picking the most
+ * active part of the song first with MODOPUS_START_LOUDEST.
+ * return false if the song could not be analysed
+ */
+static bool start_clip(modopus_source *src, loaded_module *lm, const char *filepath, const modopus_settings opt, FILE *out){
+  double start = opt.clip_start;
+  if(start == MODOPUS_START_LOUDEST){
+    start = loudest_region(filepath, lm->file, opt.clip_length, opt);
+    if(start < 0){
+      fprintf(stderr, "%s: failed finding the most active part\n", filepath);
+      return false;
+    }
+  }
+  if(src->pcm != NULL){
+    size_t frame = (size_t)llround(start * opt.samplerate);
+    src->pcm_pos = frame < src->pcm_frames ? frame : src->pcm_frames;
+  }
+  else if(start > 0){
+    // Seeking lands on the start of a row, which may be a little earlier
+    start = openmpt_module_set_position_seconds(lm->mod, start);
+  }
+  if(opt.clip_length > 0){
+    src->clip_left = (size_t)llround(opt.clip_length * opt.samplerate);
+    src->fade_frames = (size_t)llround(opt.fade_out * opt.samplerate);
+    if(src->fade_frames > src->clip_left){
+      src->fade_frames = src->clip_left;
+    }
+  }
+  if(!opt.quiet){
+    if(opt.clip_length > 0){
+      fprintf(out, "Clip:           %.1f s from %.1f s, %.1f s fade-out\n\n",
+          opt.clip_length, start, (double)src->fade_frames / opt.samplerate);
+    }
+    else{
+      fprintf(out, "Clip:           from %.1f s to the end\n\n", start);
+    }
+  }
+  return true;
+}
+
+/* Encodes a loaded module to opus.
+ * param split split_path of filepath
+ * param target path to output file, NULL to derive it from filepath
+ * param out stream that receives the per file console output
+ * param stats filled in with timings and sizes
+ * param shared encoder or stream carried over between files, NULL for neither
+ * return 0 on success, 1 on failure
+ */
+static int convert_loaded(loaded_module *lm, const char *filepath, char **split, const char *target, modopus_settings opt, FILE *out, modopus_stats *stats, modopus_encoder *shared){
+  // Store comments settings in modopus_comments
+  modopus_comments comments;
+  init_comments(&comments);
+  // Auto comments
+  if(opt.auto_comment){
+    module_get_comments(lm->mod,&comments);
+  }
+  // Adds user defined comments
+  if(opt.artist != NULL){
+    comments.artist = strdup(opt.artist);
+  }
+  if(opt.title != NULL){
+    comments.title = strdup(opt.title);
+  }
+  if(opt.date != NULL){
+    comments.date = strdup(opt.date);
+  }
+
+  char *outpath = NULL;
+  outpath = target != NULL ? strdup(target) : make_outpath(split, opt);
+  if(outpath == NULL){
+    clean_comments(&comments);
+    return 1;
+  }
+
+  OggOpusComments *comm;
+  comm = create_opus_comments(comments);
+  if(comm == NULL){
+    free(outpath);
+    clean_comments(&comments);
+    return 1;
+  }
+  if(opt.input_rate != opt.samplerate){
+    // libopusenc writes the rate it is fed into the header, so a
+    // requested rate that was not rendered at is kept as a tag
+    char rate[16];
+    snprintf(rate, sizeof(rate), "%d", opt.input_rate);
+    ope_comments_add(comm, "ORIGINAL_SAMPLERATE", rate);
+  }
+  if(opt.normalize != 0){
+    normalize_loudness(lm, filepath, &opt, comm, out);
+  }
+
+  // A ladder writes one output per rung, each named after it
+  int outputs = opt.ladder_count > 0 ? opt.ladder_count : 1;
+  char *outpaths[MODOPUS_MAX_RUNGS] = {NULL};
+  OggOpusEnc *encs[MODOPUS_MAX_RUNGS] = {NULL};
+  live_clock own_clock;
+  modopus_sink own_sink = {opt.output_stream, 0, opt.live && opt.output_stream != NULL ? &own_clock : NULL};
+  modopus_sink *sink = shared != NULL ? &shared->sink : &own_sink;
+  uint64_t sink_start = sink->bytes;
+  if(sink->clock != NULL){
+    live_clock_start(sink->clock);
+  }
+  bool keep = shared != NULL && shared->reuse;
+  int error = 0;
+  for(int i = 0; i < outputs && error == 0; i ++){
+    modopus_settings rung = opt;
+    if(opt.ladder_count > 0){
+      char suffix[sizeof(opt.ladder[i].name) + 1] = "-";
+      strcat(suffix, opt.ladder[i].name);
+      rung = rung_settings(opt, i);
+      outpaths[i] = suffix_path(outpath, suffix);
+    }
+    else{
+      outpaths[i] = strdup(outpath);
+    }
+    if(outpaths[i] == NULL){
+      error = 1;
+      break;
+    }
+    if(keep && shared->enc != NULL){
+      // Links of a chained stream need their own serial numbers
+      if(shared->chain && rung.serialno >= 0){
+        rung.serialno = (rung.serialno + ++ shared->links) & UINT32_MAX;
+      }
+      if(continue_opus_encoder(shared->enc, shared->chain ? NULL : outpaths[i], rung, comm)){
+        encs[i] = shared->enc;
+      }
+      else{
+        ope_encoder_destroy(shared->enc);
+      }
+    }
+    else if(opt.output_stream != NULL){
+      // A fresh encoder on a stream that was written to starts the next link
+      if(shared != NULL && sink->bytes > 0 && rung.serialno >= 0){
+        rung.serialno = (rung.serialno + ++ shared->links) & UINT32_MAX;
+      }
+      encs[i] = create_opus_stream_encoder(sink, rung, comm);
+    }
+    else{
+      encs[i] = create_opus_encoder(outpaths[i], rung, comm);
+    }
+    if(keep){
+      shared->enc = encs[i];
+    }
+    if(encs[i] == NULL){
+      error = 1;
+      break;
+    }
+    if(!opt.quiet){
+      print_settings(out, filepath, outpaths[i], rung);
+    }
+  }
+
+  // Transfer pcm output from openmpt module or pcm cache to opus encoder
+  modopus_source src;
+  init_source(&src, lm->mod);
+  pcm_record record;
+  segment_renderer segments;
+  bool clip = opt.clip_start != 0 || opt.clip_length > 0;
+  if(lm->pcm_hit){
+    src.pcm = lm->cached.pcm;
+    src.pcm_frames = lm->cached.frames;
+  }
+  else if(error == 0 && opt.segment_length > 0 && lm->file != NULL){
+    // Segments are not recorded, the pcm cache holds serial renders only
+    if(segments_start(&segments, lm->file, filepath, openmpt_module_get_duration_seconds(lm->mod), opt)){
+      src.segments = &segments;
+    }
+    else{
+      error = 1;
+    }
+  }
+  else if(error == 0 && !clip && lm->pcm_path != NULL && pcm_record_start(&record, lm->pcm_path, opt)){
+    src.record = &record;
+  }
+  if(error == 0 && clip && !start_clip(&src, lm, filepath, opt, out)){
+    error = 1;
+  }
+  if(error == 0 && opt.ladder_count > 0){
+    error = convert_stream_ladder(&src, encs, opt, stats);
+  }
+  else if(error == 0){
+    error = convert_stream(&src, encs[0], sink->clock, opt, stats);
+  }
+  // Rendering stops early on errors and trimmed silence, keep only whole songs
+  if(src.record != NULL){
+    pcm_record_finish(&record, src.ended);
+  }
+  if(src.segments != NULL && !segments_finish(&segments, opt.quiet ? NULL : out)){
+    error = 1;
+  }
+  if(error != 0){
+    for(int i = 0; i < outputs; i ++){
+      if(encs[i] != NULL){
+        ope_encoder_destroy(encs[i]);
+      }
+      free(outpaths[i]);
+    }
+    if(keep){
+      shared->enc = NULL;
+    }
+    ope_comments_destroy(comm);
+    free(outpath);
+    clean_comments(&comments);
+    fprintf(out, "failed\n");
+    return 1;
+  }
+
+  if(!opt.quiet && opt.complexity == MODOPUS_COMPLEXITY_AUTO){
+    fprintf(out, "Complexity:     %d chosen for %gx realtime\n\n", stats->complexity, opt.target_rtf);
+  }
+  if(!opt.quiet && opt.trim_silence){
+    fprintf(out, "Trimmed:        %.2f s leading, %.2f s trailing silence\n\n",
+        (double)stats->lead_trimmed / opt.samplerate, (double)stats->tail_trimmed / opt.samplerate);
+  }
+  if(!opt.quiet && (opt.pipeline || opt.ladder_count > 0)){
+    fprintf(out, "Ring stalls:    render %zu, encode %zu (%zu blocks)\n\n",
+        stats->render_stalls, stats->encode_stalls, opt.ring_blocks);
+  }
+  if(!opt.quiet && sink->clock != NULL){
+    fprintf(out, "Latency:        first audio after %.1f ms, pages %.1f ms average, %.1f ms max\n\n",
+        stats->first_audio * 1000, stats->latency_avg * 1000, stats->latency_max * 1000);
+  }
+
+  // Cleanup, a shared encoder writes the end of the output when it moves on
+  if(!keep){
+    double start = monotonic_seconds();
+    for(int i = 0; i < outputs; i ++){
+      ope_encoder_drain(encs[i]);
+      ope_encoder_destroy(encs[i]);
+    }
+    stats->encode_time += monotonic_seconds() - start;
+  }
+  struct stat st;
+  if(opt.output_stream != NULL){
+    stats->output_bytes = sink->bytes - sink_start;
+  }
+  else if(keep && shared->chain){
+    // Pages still buffered by the encoder count towards the next file
+    if(stat(outpaths[0], &st) == 0 && (uint64_t)st.st_size >= shared->bytes){
+      stats->output_bytes = st.st_size - shared->bytes;
+      shared->bytes = st.st_size;
+    }
+    stats->output_approx = true;
+  }
+  else{
+    // A kept encoder only writes the last pages when it moves on
+    stats->output_approx = keep;
+    for(int i = 0; i < outputs; i ++){
+      if(stat(outpaths[i], &st) == 0){
+        stats->output_bytes += st.st_size;
+      }
+    }
+  }
+  for(int i = 0; i < outputs; i ++){
+    free(outpaths[i]);
+  }
+  ope_comments_destroy(comm);
+  free(outpath);
+  clean_comments(&comments);
+  return 0;
+}
+
+
+// Adds the stats of one subsong to those of the whole file
+static void merge_stats(modopus_stats *to, const modopus_stats *from){
+  to->frames += from->frames;
+  to->render_stalls += from->render_stalls;
+  to->encode_stalls += from->encode_stalls;
+  to->load_time += from->load_time;
+  to->render_time += from->render_time;
+  to->encode_time += from->encode_time;
+  to->output_bytes += from->output_bytes;
+  to->output_approx |= from->output_approx;
+  to->complexity = from->complexity;
+  to->lead_trimmed += from->lead_trimmed;
+  to->tail_trimmed += from->tail_trimmed;
+}
+
+/* State shared between the threads converting the subsongs of one file,
+ * or its channels with --stems
+ */
+typedef struct{
+  const char *filepath;
+  char **split;
+  const char *outpath; // gets a -N or -chN suffix per output
+  modopus_file file;
+  modopus_settings opt;
+  int32_t count;
+  atomic_int next;
+  bool buffered;       // console output is collected per subsong
+  char **logs;
+  size_t *loglens;
+  modopus_stats *stats;
+  int *errors;
+  modopus_encoder *shared; // only when the subsongs convert in turn
+}subsong_state;
+
+static void *subsong_worker(void *arg){
+  subsong_state *state = arg;
+  int32_t i;
+  while((i = atomic_fetch_add(&state->next, 1)) < state->count){
+    modopus_settings opt = state->opt;
+    if(opt.stems){
+      opt.channel = i;
+    }
+    else{
+      opt.subsong = i;
+    }
+    FILE *out = state->buffered ? open_memstream(&state->logs[i], &state->loglens[i]) : NULL;
+    bool buffered = out != NULL;
+    if(!buffered){
+      out = console(opt);
+    }
+    // A stream carries the subsongs one after another
+    char *target = NULL;
+    if(opt.album != NULL){
+      target = strdup(opt.album);
+    }
+    else if(opt.output_stream == NULL){
+      // Channels count from 1 like in trackers, zero padded so stems sort
+      char suffix[16];
+      if(opt.stems){
+        snprintf(suffix, sizeof(suffix), "-ch%0*d", state->count >= 100 ? 3 : 2, i + 1);
+      }
+      else{
+        snprintf(suffix, sizeof(suffix), "-%d", i);
+      }
+      target = suffix_path(state->outpath, suffix);
+    }
+    loaded_module lm;
+    double start = monotonic_seconds();
+    bool loaded = (target != NULL || opt.output_stream != NULL)
+      && load_module(&lm, state->filepath, &state->file, opt);
+    state->stats[i].load_time = monotonic_seconds() - start;
+    state->errors[i] = 1;
+    if(loaded){
+      state->errors[i] = convert_loaded(&lm, state->filepath, state->split, target, opt, out, &state->stats[i], state->shared);
+      unload_module(&lm);
+    }
+    free(target);
+    // The log is only filled in once the memstream is closed
+    if(buffered){
+      fclose(out);
+    }
+  }
+  return NULL;
+}
+
+/* Converts every subsong of a module, each to its own output named
+ * after the subsong number. The file is read once, and opt.jobs
+ * subsongs are rendered at the same time from their own module instance.
+ * With opt.stems the outputs are the channels of the module instead,
+ * each rendered with every other channel muted.
+ * param file contents of filepath if already in memory, NULL to map it
+ * return 0 if every subsong was converted
+ */
+static int convert_subsongs(const char *filepath, const modopus_file *file, char **split, const char *target, const modopus_settings opt, FILE *out, modopus_stats *stats, modopus_encoder *shared){
+  subsong_state state;
+  if(file != NULL){
+    state.file = *file;
+  }
+  else if(!map_file(filepath, &state.file)){
+    return 1;
+  }
+  // Only the counts and metadata are read here, every subsong loads its own instance
+  double start = monotonic_seconds();
+  openmpt_module *mod = probe_mod_memory(state.file.data, state.file.size);
+  stats->load_time = monotonic_seconds() - start;
+  if(mod == NULL){
+    fprintf(stderr, "%s: failed creating openmpt_module\n", filepath);
+    if(file == NULL){
+      unmap_file(&state.file);
+    }
+    return 1;
+  }
+  if(opt.print_meta){
+    module_print_metadata(out, mod);
+  }
+  if(opt.print_sub){
+    module_print_subsongs(out, mod);
+  }
+  state.count = opt.stems ? openmpt_module_get_num_channels(mod) : openmpt_module_get_num_subsongs(mod);
+  openmpt_module_destroy(mod);
+  char *outpath = target != NULL ? strdup(target) : make_outpath(split, opt);
+  if(opt.dry_run || outpath == NULL){
+    free(outpath);
+    if(file == NULL){
+      unmap_file(&state.file);
+    }
+    return outpath == NULL;
+  }
+
+  state.filepath = filepath;
+  state.split = split;
+  state.outpath = outpath;
+  state.opt = opt;
+  atomic_init(&state.next, 0);
+  // Streams are written in order, so only files convert in parallel
+  size_t nthreads = opt.output_stream == NULL && opt.jobs > 1 ? (size_t)opt.jobs - 1 : 0;
+  if(nthreads >= (size_t)state.count){
+    nthreads = state.count > 0 ? state.count - 1 : 0;
+  }
+  state.buffered = nthreads > 0;
+  state.shared = nthreads > 0 ? NULL : shared;
+  state.logs = calloc(state.count, sizeof(char *));
+  state.loglens = calloc(state.count, sizeof(size_t));
+  state.stats = calloc(state.count, sizeof(modopus_stats));
+  state.errors = calloc(state.count, sizeof(int));
+  int failed = 0;
+  if(state.count > 0 && (state.logs == NULL || state.loglens == NULL || state.stats == NULL || state.errors == NULL)){
+    fprintf(stderr, "Failed allocating memory\n");
+    failed = 1;
+    state.count = 0;
+  }
+
+  pthread_t threads[nthreads > 0 ? nthreads : 1];
+  size_t started = 0;
+  for(; started < nthreads; started ++){
+    if(pthread_create(&threads[started], NULL, subsong_worker, &state) != 0){
+      break;
+    }
+  }
+  subsong_worker(&state);
+  for(size_t i = 0; i < started; i ++){
+    pthread_join(threads[i], NULL);
+  }
+
+  for(int32_t i = 0; i < state.count; i ++){
+    if(state.logs[i] != NULL){
+      fwrite(state.logs[i], 1, state.loglens[i], out);
+      free(state.logs[i]);
+    }
+    merge_stats(stats, &state.stats[i]);
+    failed |= state.errors[i];
+  }
+  free(state.logs);
+  free(state.loglens);
+  free(state.stats);
+  free(state.errors);
+  free(outpath);
+  if(file == NULL){
+    unmap_file(&state.file);
+  }
+  return failed;
+}
+
+/* Converts a module, read from filepath or already in memory.
+ * param file contents of filepath, NULL to read filepath
+ * see convert_file
+ */
+static int convert_input(const char *filepath, const modopus_file *file, const char *target, const modopus_settings opt, FILE *out, modopus_stats *stats, modopus_encoder *shared){
+  char **split = split_path(filepath);
+  if(split == NULL){
+    return 1;
+  }
+  if(!validate_file(split)){
+    free_split_path(split, 3);
+    return 1;
+  }
+  struct stat st;
+  if(file != NULL){
+    stats->input_bytes = file->size;
+  }
+  else if(stat(filepath, &st) == 0){
+    stats->input_bytes = st.st_size;
+  }
+  if(opt.all_subsongs || opt.stems){
+    int error = convert_subsongs(filepath, file, split, target, opt, out, stats, shared);
+    free_split_path(split, 3);
+    return error;
+  }
+
+  // Create openmpt module
+  loaded_module lm;
+  double start = monotonic_seconds();
+  bool loaded = load_module(&lm, filepath, file, opt);
+  stats->load_time = monotonic_seconds() - start;
+  if(!loaded){
+    free_split_path(split, 3);
+    return 1;
+  }
+
+  // Print subsong and metadata info
+  if(opt.print_meta){
+    module_print_metadata(out, lm.mod);
+  }
+  if(opt.print_sub){
+    module_print_subsongs(out, lm.mod);
+  }
+
+  // Moves onto the next file if dry run.
+  int error = 0;
+  if(!opt.dry_run){
+    error = convert_loaded(&lm, filepath, split, target, opt, out, stats, shared);
+  }
+  unload_module(&lm);
+  free_split_path(split, 3);
+  return error;
+}
+
+/* Converts a single module file to opus.
+ * param filepath path to input file
+ * param target path to output file, NULL to derive it from filepath
+ * param opt options struct with values set
+ * param out stream that receives the per file console output
+ * param stats zeroed stats, filled in with timings and sizes
+ * param shared encoder kept open between files, NULL for one per file
+ * return 0 on success, 1 if the file was skipped or failed
+ */
+int convert_file(const char *filepath, const char *target, const modopus_settings opt, FILE *out, modopus_stats *stats, modopus_encoder *shared){
+  double start = monotonic_seconds();
+  int error = 1;
+  // Segments are rendered from the file contents by several instances
+  if(opt.segment_length > 0 && !opt.dry_run && has_module_extension(filepath)){
+    modopus_file file;
+    if(map_file(filepath, &file)){
+      error = convert_input(filepath, &file, target, opt, out, stats, shared);
+      unmap_file(&file);
+    }
+  }
+  else{
+    error = convert_input(filepath, NULL, target, opt, out, stats, shared);
+  }
+  stats->wall_time = monotonic_seconds() - start;
+  return error;
+}
+
+/* Output path of an archive member, the layout inside the archive is
+ * kept below the -o directory.
+ */
+static char *member_outpath(const archive_member *member, const modopus_settings opt){
+  char **split = split_path(member->name);
+  if(split == NULL){
+    return NULL;
+  }
+  char *name = parse_filename(split);
+  char *outpath = NULL;
+  if(name != NULL){
+    char *inner = join_path(split[0], name);
+    outpath = join_path(opt.filename, inner);
+    free(inner);
+  }
+  free(name);
+  free_split_path(split, 3);
+  return outpath;
+}
+
+// Creates the directories leading up to path, like mkdir -p
+static bool make_parent_dirs(const char *path){
+  char *dir = strdup(path);
+  if(dir == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return false;
+  }
+  bool ok = true;
+  for(char *p = strchr(&dir[1], '/'); p != NULL && ok; p = strchr(&p[1], '/')){
+    *p = '\0';
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST){
+      fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+      ok = false;
+    }
+    *p = '/';
+  }
+  free(dir);
+  return ok;
+}
+
+/* Converts a module inside an archive, see convert_file.
+ * param target album output, NULL for the path mirroring the archive
+ */
+static int convert_member(const modopus_archive *archive, size_t index, const char *target, const modopus_settings opt, FILE *out, modopus_stats *stats, modopus_encoder *shared){
+  const archive_member *member = &archive->members[index];
+  char *outpath = NULL;
+  if(target == NULL && opt.output_stream == NULL){
+    outpath = member_outpath(member, opt);
+    if(outpath == NULL || (!opt.dry_run && !make_parent_dirs(outpath))){
+      free(outpath);
+      return 1;
+    }
+    target = outpath;
+  }
+  double start = monotonic_seconds();
+  modopus_file file;
+  int error = 1;
+  if(archive_read(archive, index, &file)){
+    error = convert_input(member->path, &file, target, opt, out, stats, shared);
+    archive_release(archive, &file);
+  }
+  stats->wall_time = monotonic_seconds() - start;
+  free(outpath);
+  return error;
+}
+
+// State shared between the worker threads of one batch
+typedef struct{
+  modopus_job *jobs;
+  size_t count;
+  atomic_size_t next;
+  atomic_size_t failed;
+  pthread_mutex_t print_lock;
+  modopus_settings opt;
+  int workers;         // files converted at the same time
+  FILE *stats_out;
+  modopus_totals totals;
+}batch_state;
+
+// Output path for an input path, NULL if it has no usable name
+static char *job_outpath(const char *path, const modopus_settings opt){
+  char **split = split_path(path);
+  if(split == NULL){
+    return NULL;
+  }
+  char *outpath = make_outpath(split, opt);
+  free_split_path(split, 3);
+  return outpath;
+}
+
+// Play time of a module inside an archive, -1 if it could not be loaded
+static double member_probe_duration(const modopus_archive *archive, size_t index){
+  modopus_file file;
+  if(!archive_read(archive, index, &file)){
+    return -1;
+  }
+  double duration = -1;
+  openmpt_module *mod = probe_mod_memory(file.data, file.size);
+  if(mod != NULL){
+    duration = openmpt_module_get_duration_seconds(mod);
+    openmpt_module_destroy(mod);
+  }
+  archive_release(archive, &file);
+  return duration;
+}
+
+static void *probe_worker(void *arg){
+  batch_state *batch = arg;
+  size_t i;
+  while((i = atomic_fetch_add(&batch->next, 1)) < batch->count){
+    modopus_job *job = &batch->jobs[i];
+    if(batch->workers > 1){
+      job->duration = job->archive != NULL ? member_probe_duration(job->archive, job->member)
+                                           : module_probe_duration(job->path);
+    }
+    if(batch->opt.cache_path != NULL && job->archive == NULL){
+      job->outpath = job_outpath(job->path, batch->opt);
+      job->hashed = job->outpath != NULL && hash_file(job->path, &job->hash, &job->size);
+    }
+  }
+  return NULL;
+}
+
+static void *convert_worker(void *arg){
+  batch_state *batch = arg;
+  // Every worker continues its own encoder from file to file
+  live_clock clock;
+  modopus_encoder shared = {NULL, {batch->opt.output_stream, 0, NULL}, 0, 0, false, false};
+  if(batch->opt.live && batch->opt.output_stream != NULL){
+    shared.sink.clock = &clock;
+  }
+  shared.chain = batch->opt.album != NULL || batch->opt.output_stream != NULL;
+  shared.reuse = batch->opt.reuse_encoder || batch->opt.album != NULL;
+  // Without reuse a stream still carries its link count from file to file
+  modopus_encoder *pass = shared.reuse || batch->opt.output_stream != NULL ? &shared : NULL;
+  size_t i;
+  while((i = atomic_fetch_add(&batch->next, 1)) < batch->count){
+    if(batch->jobs[i].skip || batch->jobs[i].primary != -1){
+      continue;
+    }
+    // The job this worker will most likely take next
+    if(i + batch->workers < batch->count){
+      const modopus_job *next = &batch->jobs[i + batch->workers];
+      if(next->archive != NULL){
+        archive_prefetch(next->archive, next->member);
+      }
+      else{
+        prefetch_file(next->path);
+      }
+    }
+    // Per file output is collected and printed in one piece,
+    // so the output of different workers is never interleaved.
+    char *log = NULL;
+    size_t loglen = 0;
+    FILE *out = batch->workers > 1 ? open_memstream(&log, &loglen) : NULL;
+    bool buffered = out != NULL;
+    if(!buffered){
+      out = console(batch->opt);
+    }
+    // Outputs may be hard links shared with other inputs from earlier runs,
+    // break the link instead of overwriting the shared file.
+    struct stat st;
+    if(batch->jobs[i].outpath != NULL && stat(batch->jobs[i].outpath, &st) == 0 && st.st_nlink > 1){
+      unlink(batch->jobs[i].outpath);
+    }
+    modopus_stats stats = {0};
+    if(batch->jobs[i].archive != NULL){
+      batch->jobs[i].ok = convert_member(batch->jobs[i].archive, batch->jobs[i].member, batch->opt.album, batch->opt, out, &stats, pass) == 0;
+    }
+    else{
+      batch->jobs[i].ok = convert_file(batch->jobs[i].path, batch->opt.album, batch->opt, out, &stats, pass) == 0;
+    }
+    if(!batch->jobs[i].ok){
+      atomic_fetch_add(&batch->failed, 1);
+    }
+    // The log is only filled in once the memstream is closed
+    if(buffered){
+      fclose(out);
+    }
+    pthread_mutex_lock(&batch->print_lock);
+    if(log != NULL){
+      fwrite(log, 1, loglen, stdout);
+      fflush(stdout);
+      free(log);
+    }
+    if(batch->stats_out != NULL){
+      print_stats_json(batch->stats_out, batch->jobs[i].path, &stats, batch->opt, batch->jobs[i].ok);
+      add_totals(&batch->totals, &stats, batch->opt, batch->jobs[i].ok);
+    }
+    pthread_mutex_unlock(&batch->print_lock);
+  }
+  if(shared.enc != NULL){
+    ope_encoder_drain(shared.enc);
+    ope_encoder_destroy(shared.enc);
+  }
+  return NULL;
+}
+
+/* Runs worker on batch->workers threads until every job in batch has been taken.
+ * The calling thread is used as one of the workers.
+ */
+static void run_workers(batch_state *batch, void *(*worker)(void *)){
+  size_t nthreads = batch->workers > 1 ? (size_t)batch->workers - 1 : 0;
+  if(nthreads > batch->count){
+    nthreads = batch->count;
+  }
+  pthread_t threads[nthreads > 0 ? nthreads : 1];
+  size_t started = 0;
+  atomic_store(&batch->next, 0);
+  for(; started < nthreads; started ++){
+    if(pthread_create(&threads[started], NULL, worker, batch) != 0){
+      fprintf(stderr, "Failed creating worker thread, continuing with %zu\n", started + 1);
+      break;
+    }
+  }
+  worker(batch);
+  for(size_t i = 0; i < started; i ++){
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// Longest job first, unknown durations (-1) end up last
+static int compare_jobs(const void *a, const void *b){
+  double da = ((const modopus_job *)a)->duration;
+  double db = ((const modopus_job *)b)->duration;
+  return (da < db) - (da > db);
+}
+
+// Orders jobs by input contents, keeping the original order for equal inputs
+static int compare_contents(const void *a, const void *b){
+  const modopus_job *ja = *(const modopus_job **)a;
+  const modopus_job *jb = *(const modopus_job **)b;
+  if(ja->hash != jb->hash)
+    return ja->hash < jb->hash ? -1 : 1;
+  if(ja->size != jb->size)
+    return ja->size < jb->size ? -1 : 1;
+  return (ja > jb) - (ja < jb);
+}
+
+/* Marks jobs whose output is already up to date in the cache, and jobs
+ * whose input is identical to an earlier job in the batch.
+ */
+static void resolve_cache(batch_state *batch, modopus_cache *cache){
+  uint64_t key = settings_key(batch->opt);
+  modopus_job **order = malloc(batch->count * sizeof(modopus_job *));
+  if(order == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return;
+  }
+  size_t hashed = 0;
+  for(size_t i = 0; i < batch->count; i ++){
+    modopus_job *job = &batch->jobs[i];
+    if(!job->hashed){
+      continue;
+    }
+    order[hashed ++] = job;
+    cache_entry *e = cache_find(cache, job->outpath);
+    if(e != NULL && e->hash == job->hash && e->size == job->size && e->key == key
+        && access(job->outpath, F_OK) == 0){
+      job->skip = true;
+    }
+  }
+  qsort(order, hashed, sizeof(modopus_job *), compare_contents);
+  for(size_t i = 1; i < hashed; i ++){
+    modopus_job *first = order[i - 1]->primary == -1 ? order[i - 1] : &batch->jobs[order[i - 1]->primary];
+    if(order[i]->hash == first->hash && order[i]->size == first->size){
+      order[i]->primary = first - batch->jobs;
+    }
+  }
+  free(order);
+}
+
+/* Gives duplicate inputs the output of their primary job and records
+ * everything that was written in the cache.
+ */
+static void finish_cache(batch_state *batch, modopus_cache *cache){
+  uint64_t key = settings_key(batch->opt);
+  for(size_t i = 0; i < batch->count; i ++){
+    modopus_job *job = &batch->jobs[i];
+    if(job->primary == -1 || job->skip){
+      continue;
+    }
+    modopus_job *primary = &batch->jobs[job->primary];
+    job->ok = (primary->ok || primary->skip) && link_output(primary->outpath, job->outpath);
+    if(!job->ok){
+      atomic_fetch_add(&batch->failed, 1);
+    }
+    else if(!batch->opt.quiet){
+      fprintf(console(batch->opt), "Linked:         %s -> %s\n", job->outpath, primary->outpath);
+    }
+  }
+  for(size_t i = 0; i < batch->count; i ++){
+    modopus_job *job = &batch->jobs[i];
+    if(job->skip){
+      batch->totals.skipped ++;
+      if(!batch->opt.quiet){
+        fprintf(console(batch->opt), "Unchanged:      %s\n", job->path);
+      }
+    }
+    if(job->ok && job->hashed){
+      cache_set(cache, job->outpath, job->hash, job->size, key);
+    }
+  }
+}
+
+/* Converts every file in paths.
+ * With opt.jobs > 1 the files are converted concurrently, longest module
+ * first, so a long module doesn't end up running alone at the end.
+ * With opt.cache_path set, inputs that haven't changed since the last run
+ * are skipped and identical inputs are only converted once.
+ * Tar and zip archives are converted module by module, see convert_member.
+ * param paths input file paths
+ * param count number of paths
+ * param opt options struct with values set
+ * return number of files that failed
+ */
+int run_batch(char **paths, size_t count, const modopus_settings opt){
+  if(count == 0){
+    return 0;
+  }
+  // Archives are opened up front, each of their modules becomes a job
+  modopus_archive *archives = calloc(count, sizeof(modopus_archive));
+  if(archives == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return (int)count;
+  }
+  size_t opened = 0;
+  size_t njobs = 0;
+  int bad_archives = 0;
+  for(size_t i = 0; i < count; i ++){
+    if(!is_archive(paths[i])){
+      njobs ++;
+    }
+    else if(archive_open(paths[i], &archives[opened])){
+      njobs += archives[opened ++].count;
+    }
+    else{
+      bad_archives ++;
+    }
+  }
+  batch_state batch;
+  batch.jobs = calloc(njobs > 0 ? njobs : 1, sizeof(modopus_job));
+  if(batch.jobs == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    for(size_t i = 0; i < opened; i ++){
+      archive_close(&archives[i]);
+    }
+    free(archives);
+    return (int)count;
+  }
+  batch.count = njobs;
+  batch.opt = opt;
+  // Subsongs, stems or segments of a file take the -j threads, files are converted in turn
+  batch.workers = opt.all_subsongs || opt.stems || opt.segment_length > 0 ? 1 : opt.jobs;
+  atomic_init(&batch.next, 0);
+  atomic_init(&batch.failed, bad_archives);
+  pthread_mutex_init(&batch.print_lock, NULL);
+  batch.stats_out = NULL;
+  memset(&batch.totals, 0, sizeof(batch.totals));
+  batch.totals.start = monotonic_seconds();
+  if(opt.stats){
+    batch.stats_out = opt.stats_path == NULL ? stderr : fopen(opt.stats_path, "w");
+    if(batch.stats_out == NULL){
+      fprintf(stderr, "%s: %s\n", opt.stats_path, strerror(errno));
+    }
+  }
+  size_t n = 0;
+  size_t next_archive = 0;
+  for(size_t i = 0; i < count; i ++){
+    if(!is_archive(paths[i])){
+      batch.jobs[n ++].path = paths[i];
+      continue;
+    }
+    if(next_archive == opened || archives[next_archive].path != paths[i]){
+      continue; // failed to open
+    }
+    const modopus_archive *archive = &archives[next_archive ++];
+    for(size_t m = 0; m < archive->count; m ++){
+      batch.jobs[n].path = archive->members[m].path;
+      batch.jobs[n].archive = archive;
+      batch.jobs[n ++].member = m;
+    }
+  }
+  for(size_t i = 0; i < njobs; i ++){
+    batch.jobs[i].duration = -1;
+    batch.jobs[i].primary = -1;
+  }
+
+  // Estimate durations and hash inputs in parallel, then schedule the longest first.
+  if(batch.workers > 1 || opt.cache_path != NULL){
+    run_workers(&batch, probe_worker);
+  }
+  if(batch.workers > 1){
+    qsort(batch.jobs, njobs, sizeof(modopus_job), compare_jobs);
+  }
+  modopus_cache cache;
+  bool use_cache = opt.cache_path != NULL && cache_load(&cache, opt.cache_path);
+  if(use_cache){
+    resolve_cache(&batch, &cache);
+  }
+  run_workers(&batch, convert_worker);
+  if(use_cache){
+    finish_cache(&batch, &cache);
+    cache_save(&cache, opt.cache_path);
+    cache_free(&cache);
+  }
+
+  if(batch.stats_out != NULL){
+    print_totals_json(batch.stats_out, &batch.totals);
+    if(batch.stats_out != stderr){
+      fclose(batch.stats_out);
+    }
+  }
+
+  pthread_mutex_destroy(&batch.print_lock);
+  for(size_t i = 0; i < njobs; i ++){
+    free(batch.jobs[i].outpath);
+  }
+  free(batch.jobs);
+  for(size_t i = 0; i < opened; i ++){
+    archive_close(&archives[i]);
+  }
+  free(archives);
+  return (int)atomic_load(&batch.failed);
+}
@@ -0,0 +1,39 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <opusenc.h>
+
+#include "modopus.h"
+#include "archive.h"
+
+// A single input file queued for conversion
+typedef struct{
+  const char *path;
+  double duration;
+  char *outpath;
+  uint64_t hash;
+  uint64_t size;
+  bool hashed;
+  bool skip;    // output is up to date according to the cache
+  long primary; // index of the job with identical input, or -1
+  bool ok;
+  const modopus_archive *archive; // archive holding the module, or NULL
+  size_t member;                  // index of the module in archive
+}modopus_job;
+
+// An encoder kept open from one file to the next, see --reuse-encoder and --album
+typedef struct{
+  OggOpusEnc *enc;
+  modopus_sink sink; // destination when streaming
+  uint64_t bytes;    // size of a chained output before the current file
+  uint32_t links;    // streams chained after the first one
+  bool chain;        // files follow each other in one chained Ogg stream
+  bool reuse;        // enc carries over, otherwise only the stream does
+}modopus_encoder;
+
+int convert_file(const char *, const char *, const modopus_settings, FILE *, modopus_stats *, modopus_encoder *);
+int run_batch(char **, size_t, const modopus_settings);
+#endif
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "modopus.h"
+#include "mapfile.h"
+#include "cache.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define MANIFEST_HEADER "modopus-cache 1"
+
+/* 64-bit FNV-1a, continuing from h.
+ * Start with hash_bytes(0, ...) for a fresh hash.
+ */
+uint64_t hash_bytes(uint64_t h, const void *data, size_t size){
+  const unsigned char *p = data;
+  if(h == 0){
+    h = FNV_OFFSET;
+  }
+  for(size_t i = 0; i < size; i ++){
+    h ^= p[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static uint64_t hash_string(uint64_t h, const char *str){
+  // The terminator is hashed too, so "ab","c" and "a","bc" differ
+  return str == NULL ? hash_bytes(h, "", 1) : hash_bytes(h, str, strlen(str) + 1);
+}
+
+/* Hashes every setting that changes the bytes of the output file.
+ * Fields that only affect printing or scheduling are left out.
+ */
+uint64_t settings_key(const modopus_settings opt){
+  int32_t fields[] = {
+    opt.framesize,
+    opt.samplerate,
+    opt.input_rate,
+    opt.repeat_count,
+    opt.interpolation,
+    opt.gain,
+    opt.subsong,
+    opt.complexity,
+    opt.bitrate,
+    opt.bitrate_mode,
+    opt.channels,
+    opt.auto_comment,
+    opt.trim_silence,
+    (int32_t)(opt.trim_silence ? opt.silence_threshold * 1000 : 0),
+    (int32_t)(opt.trim_silence ? opt.silence_hold * 1000 : 0),
+    (int32_t)(opt.normalize * 1000),
+    opt.sample_format,
+    (int32_t)(opt.segment_length * 1000),
+    (int32_t)(opt.segment_length > 0 ? opt.segment_preroll * 1000 : 0),
+    (int32_t)(opt.clip_start * 1000),
+    (int32_t)(opt.clip_length * 1000),
+    (int32_t)(opt.clip_length > 0 ? opt.fade_out * 1000 : 0)
+  };
+  uint64_t h = hash_bytes(0, fields, sizeof(fields));
+  // A random serial number differs on every run anyway
+  if(opt.serialno >= 0){
+    h = hash_bytes(h, &opt.serialno, sizeof(opt.serialno));
+  }
+  h = hash_string(h, opt.artist);
+  h = hash_string(h, opt.title);
+  h = hash_string(h, opt.date);
+  return h;
+}
+
+/* Hashes the contents of the file at path.
+ * return false if the file could not be read
+ */
+bool hash_file(const char *path, uint64_t *hash, uint64_t *size){
+  modopus_file file;
+  if(!map_file(path, &file)){
+    return false;
+  }
+  *hash = hash_bytes(0, file.data, file.size);
+  *size = file.size;
+  unmap_file(&file);
+  return true;
+}
+
+static int compare_entries(const void *a, const void *b){
+  return strcmp(((const cache_entry *)a)->outpath, ((const cache_entry *)b)->outpath);
+}
+
+static bool cache_append(modopus_cache *cache, const char *outpath, uint64_t hash, uint64_t size, uint64_t key){
+  if(cache->count == cache->cap){
+    size_t cap = cache->cap == 0 ? 64 : cache->cap * 2;
+    cache_entry *tmp = realloc(cache->entries, cap * sizeof(cache_entry));
+    if(tmp == NULL){
+      fprintf(stderr, "Failed allocating memory\n");
+      return false;
+    }
+    cache->entries = tmp;
+    cache->cap = cap;
+  }
+  char *copy = strdup(outpath);
+  if(copy == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return false;
+  }
+  cache->entries[cache->count ++] = (cache_entry){hash, size, key, copy};
+  cache->sorted = false;
+  return true;
+}
+
+/* Reads the manifest at path. A missing manifest is an empty cache.
+ * Each line holds "<hash> <size> <settings key> <output path>".
+ * return false if the file exists but could not be read
+ */
+bool cache_load(modopus_cache *cache, const char *path){
+  cache->entries = NULL;
+  cache->count = 0;
+  cache->cap = 0;
+  cache->sorted = true;
+  FILE *in = fopen(path, "r");
+  if(in == NULL){
+    if(errno == ENOENT){
+      return true;
+    }
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t n = getline(&line, &len, in);
+  if(n < 0 || strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0){
+    fprintf(stderr, "%s: not a modopus cache manifest, starting empty\n", path);
+    free(line);
+    fclose(in);
+    return true;
+  }
+  while((n = getline(&line, &len, in)) > 0){
+    if(line[n - 1] == '\n'){
+      line[n - 1] = '\0';
+    }
+    uint64_t hash, size, key;
+    int offset = 0;
+    if(sscanf(line, "%" SCNx64 " %" SCNu64 " %" SCNx64 " %n", &hash, &size, &key, &offset) != 3 || offset == 0){
+      continue;
+    }
+    if(!cache_append(cache, &line[offset], hash, size, key)){
+      break;
+    }
+  }
+  free(line);
+  fclose(in);
+  return true;
+}
+
+/* Writes the manifest to path, replacing the old one in a single rename.
+ */
+bool cache_save(modopus_cache *cache, const char *path){
+  size_t tmplen = strlen(path) + strlen(".tmp") + 1;
+  char tmppath[tmplen];
+  snprintf(tmppath, tmplen, "%s.tmp", path);
+  FILE *out = fopen(tmppath, "w");
+  if(out == NULL){
+    fprintf(stderr, "%s: %s\n", tmppath, strerror(errno));
+    return false;
+  }
+  if(!cache->sorted){
+    qsort(cache->entries, cache->count, sizeof(cache_entry), compare_entries);
+    cache->sorted = true;
+  }
+  fprintf(out, "%s\n", MANIFEST_HEADER);
+  for(size_t i = 0; i < cache->count; i ++){
+    cache_entry *e = &cache->entries[i];
+    fprintf(out, "%016" PRIx64 " %" PRIu64 " %016" PRIx64 " %s\n", e->hash, e->size, e->key, e->outpath);
+  }
+  if(fclose(out) != 0 || rename(tmppath, path) != 0){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    unlink(tmppath);
+    return false;
+  }
+  return true;
+}
+
+void cache_free(modopus_cache *cache){
+  for(size_t i = 0; i < cache->count; i ++){
+    free(cache->entries[i].outpath);
+  }
+  free(cache->entries);
+  cache->entries = NULL;
+  cache->count = 0;
+  cache->cap = 0;
+}
+
+cache_entry *cache_find(modopus_cache *cache, const char *outpath){
+  if(!cache->sorted){
+    qsort(cache->entries, cache->count, sizeof(cache_entry), compare_entries);
+    cache->sorted = true;
+  }
+  cache_entry needle = {0, 0, 0, (char *)outpath};
+  return bsearch(&needle, cache->entries, cache->count, sizeof(cache_entry), compare_entries);
+}
+
+/* Records that outpath was made from an input with the given hash and
+ * size, using the settings behind key.
+ */
+bool cache_set(modopus_cache *cache, const char *outpath, uint64_t hash, uint64_t size, uint64_t key){
+  // Paths with newlines can't be stored in the line based manifest
+  if(strchr(outpath, '\n') != NULL){
+    return false;
+  }
+  cache_entry *e = cache_find(cache, outpath);
+  if(e != NULL){
+    e->hash = hash;
+    e->size = size;
+    e->key = key;
+    return true;
+  }
+  return cache_append(cache, outpath, hash, size, key);
+}
+
+static bool copy_file(const char *from, const char *to){
+  FILE *in = fopen(from, "rb");
+  if(in == NULL){
+    fprintf(stderr, "%s: %s\n", from, strerror(errno));
+    return false;
+  }
+  FILE *out = fopen(to, "wb");
+  if(out == NULL){
+    fprintf(stderr, "%s: %s\n", to, strerror(errno));
+    fclose(in);
+    return false;
+  }
+  char buf[1 << 16];
+  size_t n;
+  bool ok = true;
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0){
+    if(fwrite(buf, 1, n, out) != n){
+      ok = false;
+      break;
+    }
+  }
+  ok = ok && !ferror(in);
+  fclose(in);
+  if(fclose(out) != 0 || !ok){
+    fprintf(stderr, "%s: failed copying from %s\n", to, from);
+    return false;
+  }
+  return true;
+}
+
+/* Makes to a hard link of from, falling back to a copy when the two are
+ * on different file systems or links aren't supported.
+ */
+bool link_output(const char *from, const char *to){
+  if(strcmp(from, to) == 0){
+    return true;
+  }
+  unlink(to);
+  if(link(from, to) == 0){
+    return true;
+  }
+  return copy_file(from, to);
+}
@@ -0,0 +1,35 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "modopus.h"
+
+// One converted output and what it was made from
+typedef struct{
+  uint64_t hash;
+  uint64_t size;
+  uint64_t key;
+  char *outpath;
+}cache_entry;
+
+// Manifest of previous conversions, kept sorted by outpath
+typedef struct{
+  cache_entry *entries;
+  size_t count;
+  size_t cap;
+  bool sorted;
+}modopus_cache;
+
+uint64_t hash_bytes(uint64_t, const void *, size_t);
+uint64_t settings_key(const modopus_settings);
+bool hash_file(const char *, uint64_t *, uint64_t *);
+
+bool cache_load(modopus_cache *, const char *);
+bool cache_save(modopus_cache *, const char *);
+void cache_free(modopus_cache *);
+cache_entry *cache_find(modopus_cache *, const char *);
+bool cache_set(modopus_cache *, const char *, uint64_t, uint64_t, uint64_t);
+
+bool link_output(const char *, const char *);
+#endif
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <libopenmpt/libopenmpt.h>
+
+#include "modopus.h"
+#include "loudness.h"
+
+// The analysis render only has to be close, not pretty
+#define ANALYSIS_RATE 24000
+#define ANALYSIS_INTERPOLATION 1
+
+/* Sets up the K-weighting filters for samplerate. The coefficients come
+ * from the analog prototypes of BS.1770, so any rate can be measured,
+ * not just the 48 kHz the standard lists coefficients for.
+ * param channels 1, 2 or 4, rear channels of quad weigh +1.5 dB
+ * return false if memory could not be allocated
+ */
+bool meter_init(loudness_meter *meter, int32_t samplerate, int channels){
+  // High shelf modelling the acoustic effect of the head
+  double f0 = 1681.974450955533;
+  double gain = 3.999843853973347;
+  double q = 0.7071752369554196;
+  double k = tan(M_PI * f0 / samplerate);
+  double vh = pow(10, gain / 20);
+  double vb = pow(vh, 0.4996667741545416);
+  double a0 = 1 + k / q + k * k;
+  meter->shelf = (biquad){
+    (vh + vb * k / q + k * k) / a0,
+    2 * (k * k - vh) / a0,
+    (vh - vb * k / q + k * k) / a0,
+    2 * (k * k - 1) / a0,
+    (1 - k / q + k * k) / a0
+  };
+  // RLB high pass
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan(M_PI * f0 / samplerate);
+  a0 = 1 + k / q + k * k;
+  meter->highpass = (biquad){1, -2, 1, 2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0};
+
+  meter->channels = channels;
+  for(int c = 0; c < 4; c ++){
+    meter->weights[c] = channels == 4 && c >= 2 ? 1.41 : 1.0;
+  }
+  meter->state = calloc(channels, sizeof(double[4]));
+  meter->part_len = samplerate / 10;
+  meter->part_pos = 0;
+  meter->part_sum = 0;
+  meter->parts = NULL;
+  meter->count = 0;
+  meter->cap = 0;
+  if(meter->state == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return false;
+  }
+  return true;
+}
+
+static double biquad_run(const biquad *f, double *z, double x){
+  double y = f->b0 * x + z[0];
+  z[0] = f->b1 * x - f->a1 * y + z[1];
+  z[1] = f->b2 * x - f->a2 * y;
+  return y;
+}
+
+// Adds frames of interleaved pcm to the measurement
+void meter_add(loudness_meter *meter, const float *pcm, size_t frames){
+  for(size_t i = 0; i < frames; i ++){
+    for(int c = 0; c < meter->channels; c ++){
+      double *z = meter->state[c];
+      double y = biquad_run(&meter->shelf, &z[0], pcm[i * meter->channels + c]);
+      y = biquad_run(&meter->highpass, &z[2], y);
+      meter->part_sum += meter->weights[c] * y * y;
+    }
+    if(++ meter->part_pos < meter->part_len){
+      continue;
+    }
+    if(meter->count == meter->cap){
+      size_t cap = meter->cap == 0 ? 1024 : meter->cap * 2;
+      double *tmp = realloc(meter->parts, cap * sizeof(double));
+      if(tmp == NULL){
+        // Loudness of what fit is still a fair estimate
+        meter->part_pos = 0;
+        meter->part_sum = 0;
+        continue;
+      }
+      meter->parts = tmp;
+      meter->cap = cap;
+    }
+    meter->parts[meter->count ++] = meter->part_sum / meter->part_len;
+    meter->part_pos = 0;
+    meter->part_sum = 0;
+  }
+}
+
+/* Gated integrated loudness of everything added so far.
+ * return loudness in LUFS, -HUGE_VAL if all of it is below the -70 LUFS gate
+ */
+double meter_integrated(const loudness_meter *meter){
+  double threshold = -HUGE_VAL;
+  double result = -HUGE_VAL;
+  // First pass applies the absolute gate, the second the relative one
+  for(int pass = 0; pass < 2; pass ++){
+    double sum = 0;
+    size_t blocks = 0;
+    for(size_t i = 3; i < meter->count; i ++){
+      double z = (meter->parts[i - 3] + meter->parts[i - 2] + meter->parts[i - 1] + meter->parts[i]) / 4;
+      double l = -0.691 + 10 * log10(z);
+      if(l > -70 && l > threshold){
+        sum += z;
+        blocks ++;
+      }
+    }
+    if(blocks == 0){
+      return -HUGE_VAL;
+    }
+    result = -0.691 + 10 * log10(sum / blocks);
+    threshold = result - 10;
+  }
+  return result;
+}
+
+void meter_free(loudness_meter *meter){
+  free(meter->state);
+  free(meter->parts);
+  meter->state = NULL;
+  meter->parts = NULL;
+}
+
+/* Renders a module into meter with a cheap render, at a reduced rate
+ * and without interpolation. Gain, repeat count, subsong and channels
+ * are those of the real conversion.
+ * param file contents of path if already in memory, NULL to read path
+ * return false if the module could not be rendered
+ */
+static bool analyse_module(const char *path, const modopus_file *file, const modopus_settings opt, loudness_meter *meter){
+  modopus_settings analysis = opt;
+  analysis.interpolation = ANALYSIS_INTERPOLATION;
+  analysis.samplerate = ANALYSIS_RATE;
+  analysis.buffersize = ANALYSIS_RATE / 10;
+  // The meter takes floats, whatever the conversion uses
+  analysis.sample_format = MODOPUS_FLOAT;
+  openmpt_module *mod = file != NULL
+    ? create_mod_from_memory(file->data, file->size, path, analysis)
+    : create_mod(path, analysis);
+  if(mod == NULL){
+    return false;
+  }
+  if(opt.subsong >= 0 && !openmpt_module_select_subsong(mod, opt.subsong)){
+    openmpt_module_destroy(mod);
+    return false;
+  }
+  float *buffer = malloc(analysis.buffersize * opt.channels * sizeof(float));
+  if(buffer == NULL || !meter_init(meter, ANALYSIS_RATE, opt.channels)){
+    free(buffer);
+    openmpt_module_destroy(mod);
+    return false;
+  }
+  size_t count;
+  while((count = render_block(mod, analysis, buffer)) > 0){
+    meter_add(meter, buffer, count);
+  }
+  free(buffer);
+  openmpt_module_destroy(mod);
+  return true;
+}
+
+/* Measures the loudness of a module, see analyse_module.
+ * return loudness in LUFS, NAN if the module could not be rendered
+ */
+double measure_loudness(const char *path, const modopus_file *file, const modopus_settings opt){
+  loudness_meter meter;
+  if(!analyse_module(path, file, opt, &meter)){
+    return NAN;
+  }
+  double lufs = meter_integrated(&meter);
+  meter_free(&meter);
+  return lufs;
+}
+
+/* Finds the most active part of a module for --start auto, the window
+ * of length seconds with the most K-weighted energy, in 100 ms steps.
+ * param length seconds the window lasts
+ * return start of the window in seconds, -1 if the module could not be rendered
+ */
+double loudest_region(const char *path, const modopus_file *file, double length, const modopus_settings opt){
+  loudness_meter meter;
+  if(!analyse_module(path, file, opt, &meter)){
+    return -1;
+  }
+  size_t window = (size_t)(length * 10);
+  if(window == 0){
+    window = 1;
+  }
+  size_t best = 0;
+  if(meter.count > window){
+    double sum = 0;
+    for(size_t i = 0; i < window; i ++){
+      sum += meter.parts[i];
+    }
+    double best_sum = sum;
+    for(size_t i = window; i < meter.count; i ++){
+      sum += meter.parts[i] - meter.parts[i - window];
+      if(sum > best_sum){
+        best_sum = sum;
+        best = i + 1 - window;
+      }
+    }
+  }
+  meter_free(&meter);
+  return best / 10.0;
+}
+
+/* Measures the loudness of audio from the pcm cache, which is already
+ * rendered at full quality.
+ * return loudness in LUFS, NAN on failure
+ */
+double measure_pcm_loudness(const float *pcm, size_t frames, const modopus_settings opt){
+  loudness_meter meter;
+  if(!meter_init(&meter, opt.samplerate, opt.channels)){
+    return NAN;
+  }
+  meter_add(&meter, pcm, frames);
+  double lufs = meter_integrated(&meter);
+  meter_free(&meter);
+  return lufs;
+}
@@ -0,0 +1,40 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "modopus.h"
+#include "mapfile.h"
+
+// Second order IIR section, transposed direct form II
+typedef struct{
+  double b0, b1, b2, a1, a2;
+}biquad;
+
+/* EBU R128 / ITU-R BS.1770 integrated loudness of interleaved pcm.
+ * Audio is K-weighted and summed into 100 ms parts, four of which
+ * make up one 400 ms gating block.
+ */
+typedef struct{
+  int channels;
+  biquad shelf;
+  biquad highpass;
+  double (*state)[4];  // filter state per channel, two per section
+  double weights[4];
+  size_t part_len;     // frames in 100 ms
+  size_t part_pos;
+  double part_sum;
+  double *parts;       // mean square of every finished part
+  size_t count;
+  size_t cap;
+}loudness_meter;
+
+bool meter_init(loudness_meter *, int32_t, int);
+void meter_add(loudness_meter *, const float *, size_t);
+double meter_integrated(const loudness_meter *);
+void meter_free(loudness_meter *);
+
+double measure_loudness(const char *, const modopus_file *, const modopus_settings);
+double loudest_region(const char *, const modopus_file *, double, const modopus_settings);
+double measure_pcm_loudness(const float *, size_t, const modopus_settings);
+#endif
@@ -4,12 +4,19 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
 
 #include <libopenmpt/libopenmpt.h>
 #include <opusenc.h>
 
 #include "modopus.h"
 #include "split_path.h"
+#include "batch.h"
+#include "options.h"
+#include "serve.h"
+#include "scan.h"
 
 /* Prints information on how to use options.
  * param name the name of the executable
@@ -18,13 +25,35 @@ void usage(const char* name){
   printf("Usage:\n");
   printf("  %s <option(s)> <input filename>\n",name);
   printf("The output file will have the same name as the input file, with .opus file extension.\n");
+  printf("Modules inside .tar and .zip inputs are converted without extracting them,\n");
+  printf("with the directories of the archive recreated below the output directory.\n");
   printf("\nOptions:\n");
   printf("  -h, --help         Shows this.\n");
   printf("  --supported        Shows the list of supported file formats.\n");
   printf("  -o n               Output directory. Must exist before using.\n");
+  printf("                     Use - to write to stdout. If n is a named pipe,\n");
+  printf("                     the output is written to it.\n");
   printf("  -q, --quiet        Runs without printing information.\n");
+  printf("  --serve n          Run as a daemon converting requests sent to the\n");
+  printf("                     unix socket n. See src/serve.c for the protocol.\n");
+  printf("  --live             Keep latency low when streaming to stdout or a fifo.\n");
+  printf("                     Audio is encoded without look-ahead and every block\n");
+  printf("                     is sent on its own page as soon as it is ready.\n");
+  printf("  --realtime         Convert no faster than playback speed.\n");
+  printf("  --lookahead n      Milliseconds --realtime may run ahead. Default 200.\n");
+  printf("  --stats json       Print per file timings and sizes as JSON lines,\n");
+  printf("                     followed by a summary of the batch.\n");
+  printf("  --stats-file n     Write the stats to n instead of stderr.\n");
+  printf("  -j, --jobs n       Convert n files at the same time.\n");
+  printf("  --album n          Write every input to n as one gapless chained Ogg\n");
+  printf("                     stream, in the order given. Use - for stdout.\n");
+  printf("  --cache n          Use n as the conversion manifest. Unchanged inputs\n");
+  printf("                     are skipped, identical inputs converted once.\n");
   printf("\nRendering options:\n");
-  printf("  --samplerate n     Set samplerate to n.\n");
+  printf("  --samplerate n     Set samplerate to n. Rendering stays at 48 kHz, the\n");
+  printf("                     Opus rate, and n is kept as the original rate.\n");
+  printf("  --native-rate      Render at --samplerate and let the encoder resample.\n");
+  printf("  --channels n       Render and encode n channels, one of [1, 2, 4].\n");
   printf("  --framesize n      Set the frame size (ms) to n.\n");
   printf("                     Must be the following [2.5, 5, 10, 20, 40, 60].\n");
   printf("  --repeat-count n   Repeat the song n times after playing once.\n");
@@ -36,7 +65,62 @@ void usage(const char* name){
   printf("                       4: cubic interpolation\n");
   printf("                       8: windowed sinc with 8 taps\n");
   printf("  --gain n           Set master gain in mB to n.\n");
+  printf("  --subsong n        Convert subsong n instead of the default one.\n");
+  printf("  --all-subsongs     Convert every subsong to song-n.opus. With -j, the\n");
+  printf("                     subsongs of a file are converted at the same time.\n");
+  printf("  --stems            Convert every channel on its own to song-chNN.opus,\n");
+  printf("                     with the other channels muted. The file is read once\n");
+  printf("                     and with -j the channels are rendered at the same time.\n");
+  printf("  --start n          Start converting n seconds into the song. auto starts\n");
+  printf("                     at the most active part, found with a quick render.\n");
+  printf("  --duration n       Convert only n seconds of the song.\n");
+  printf("  --fade-out n       Fade the last n seconds of a --duration clip out.\n");
+  printf("  --preview          Short, small clips for catalogs, the same as\n");
+  printf("                     --preset preview: --start auto --duration 30\n");
+  printf("                     --fade-out 3 --bitrate 48 --vbr --complexity 5.\n");
+  printf("  --normalize n      Set the Opus output gain so the song plays at n LUFS.\n");
+  printf("                     Loudness is measured with a quick extra render.\n");
+  printf("  --trim-silence     Drop leading silence and stop at trailing silence.\n");
+  printf("  --silence-threshold n\n");
+  printf("                     Level in dBFS below which audio is silent. Default -60.\n");
+  printf("  --silence-hold n   Seconds of silence that end the song. Default 2.\n");
   printf("  --dry-run          Run the program, skipping writing to file.\n");
+  printf("\nEncoder options:\n");
+  printf("  --preset n         Encoder profile, one of [fast, balanced, archive,\n");
+  printf("                     preview]. preview also cuts a clip, see --preview.\n");
+  printf("                     Options after the preset override it.\n");
+  printf("  --complexity n     Encoder complexity 0-10, higher is slower and better.\n");
+  printf("                     auto picks the highest that keeps --target-rtf,\n");
+  printf("                     its output is never cached.\n");
+  printf("  --target-rtf n     Realtime factor for --complexity auto. Default 20.\n");
+  printf("  --bitrate n        Target bitrate in kbit/s.\n");
+  printf("  --vbr              Use variable bitrate.\n");
+  printf("  --cvbr             Use constrained variable bitrate.\n");
+  printf("  --hard-cbr         Use constant bitrate.\n");
+  printf("  --ladder n         Encode several outputs from one render. n is a list of\n");
+  printf("                     name:kbit/s[:framesize], such as hi:192,lo:48:40.\n");
+  printf("                     Each output is named song-name.opus.\n");
+  printf("  --serialno n       Use n as the Ogg serial number instead of a random one,\n");
+  printf("                     so the same input always gives the same output.\n");
+  printf("\nPerformance options:\n");
+  printf("  --pipeline         Render and encode on separate threads.\n");
+  printf("  --segments n       Split the song into segments of n seconds and render\n");
+  printf("                     them on the -j threads, for long modules. Files are\n");
+  printf("                     then converted one at a time.\n");
+  printf("  --preroll n        Seconds rendered and dropped before each segment so\n");
+  printf("                     effects settle. Default 2.\n");
+  printf("  --verify-segments  Also render serially and report how far the\n");
+  printf("                     segmented render differs from it.\n");
+  printf("  --ring-blocks n    Number of buffersize blocks between the threads.\n");
+  printf("                     Default 16.\n");
+  printf("  --sample-format n  Samples passed from libopenmpt to libopusenc, one of\n");
+  printf("                     [float, s16]. s16 moves half the data, float keeps\n");
+  printf("                     the full resolution. Default float. --pcm-cache is\n");
+  printf("                     only used with float.\n");
+  printf("  --reuse-encoder    Keep one encoder open from file to file instead of\n");
+  printf("                     setting up a new one per output.\n");
+  printf("  --pcm-cache n      Keep rendered audio in directory n. Converting a module\n");
+  printf("                     again with the same rendering options only encodes.\n");
   printf("\nComment options:\n");
   printf("  --auto-comment     Copies comments from input file.\n");
   printf("                     [artist, title, date, mesage, and the tracker type]\n");
@@ -44,6 +128,10 @@ void usage(const char* name){
   printf("  --title n          Set title to n.\n");
   printf("  --date n           Set date to n. Format YYYY-MM-DD, YYYY-MM, or YYYY\n");
   printf("\nPrint options:\n");
+  printf("  --scan n           Print metadata, subsongs and duration of every module\n");
+  printf("                     as n, one of [csv, json]. Directories are searched\n");
+  printf("                     recursively. Sample data isn't loaded, nothing is converted.\n");
+  printf("                     csv has a row per subsong.\n");
   printf("  --print-subsongs   Print subsong data.\n");
   printf("  --print-metadata   Print song metadata.\n");
 }
@@ -58,6 +146,9 @@ int main(int argc, char **argv){
   
   // Process options.
   int c = 0;
+  int error = 0;
+  const char *serve_path = NULL;
+  int scan_format = -1;
   while(1){
     int option_index = 0;
     const char* opname;
@@ -65,6 +156,8 @@ int main(int argc, char **argv){
       {"help", no_argument, 0, 'h'},
       {"supported", no_argument, 0, 0},
       {"samplerate", required_argument, 0, 0},
+      {"native-rate", no_argument, 0, 0},
+      {"channels", required_argument, 0, 0},
       {"framesize", required_argument, 0, 0},
       {"auto-comment", no_argument, 0, 0},
       {"artist", required_argument, 0, 0},
@@ -74,78 +167,97 @@ int main(int argc, char **argv){
       {"interpolation", required_argument, 0, 0},
       {"gain", required_argument, 0, 0},
       {"print-subsongs", no_argument, 0, 0},
+      {"subsong", required_argument, 0, 0},
+      {"all-subsongs", no_argument, 0, 0},
+      {"start", required_argument, 0, 0},
+      {"duration", required_argument, 0, 0},
+      {"fade-out", required_argument, 0, 0},
+      {"preview", no_argument, 0, 0},
+      {"segments", required_argument, 0, 0},
+      {"preroll", required_argument, 0, 0},
+      {"verify-segments", no_argument, 0, 0},
+      {"stems", no_argument, 0, 0},
       {"print-metadata", no_argument, 0, 0},
       {"dry-run", no_argument, 0, 0},
+      {"trim-silence", no_argument, 0, 0},
+      {"normalize", required_argument, 0, 0},
+      {"silence-threshold", required_argument, 0, 0},
+      {"silence-hold", required_argument, 0, 0},
+      {"pipeline", no_argument, 0, 0},
+      {"preset", required_argument, 0, 0},
+      {"complexity", required_argument, 0, 0},
+      {"target-rtf", required_argument, 0, 0},
+      {"ladder", required_argument, 0, 0},
+      {"bitrate", required_argument, 0, 0},
+      {"vbr", no_argument, 0, 0},
+      {"cvbr", no_argument, 0, 0},
+      {"hard-cbr", no_argument, 0, 0},
+      {"serialno", required_argument, 0, 0},
+      {"ring-blocks", required_argument, 0, 0},
+      {"sample-format", required_argument, 0, 0},
+      {"live", no_argument, 0, 0},
+      {"realtime", no_argument, 0, 0},
+      {"lookahead", required_argument, 0, 0},
       {"quiet", no_argument, 0, 'q'},
+      {"jobs", required_argument, 0, 'j'},
+      {"cache", required_argument, 0, 0},
+      {"album", required_argument, 0, 0},
+      {"reuse-encoder", no_argument, 0, 0},
+      {"pcm-cache", required_argument, 0, 0},
+      {"stats", required_argument, 0, 0},
+      {"stats-file", required_argument, 0, 0},
+      {"serve", required_argument, 0, 0},
+      {"scan", required_argument, 0, 0},
       {0, 0, 0, 0}
     };
-    c = getopt_long(argc, argv, "hqo:", long_options, &option_index);
+    c = getopt_long(argc, argv, "hqo:j:", long_options, &option_index);
     if( c == -1)
       break;
 
     switch (c){
       case 0:
         opname = long_options[option_index].name;
-        if(strcmp(opname,"samplerate") == 0){ /* set sample rate */
-          opt.samplerate = atoi(optarg);
+        error = set_option(&opt, opname, optarg, stdout);
+        if(error > 0){
+          return 1;
         }
-        else if(strcmp(opname,"framesize") == 0){ /* set frame size */
-          if(strcmp(optarg,"2.5") == 0) 
-            opt.framesize = OPUS_FRAMESIZE_2_5_MS;
-          else if(strcmp(optarg,"5") == 0) 
-            opt.framesize = OPUS_FRAMESIZE_5_MS;
-          else if(strcmp(optarg,"10") == 0) 
-            opt.framesize = OPUS_FRAMESIZE_10_MS;
-          else if(strcmp(optarg,"20") == 0)
-            opt.framesize = OPUS_FRAMESIZE_20_MS;
-          else if(strcmp(optarg,"40") == 0)
-            opt.framesize = OPUS_FRAMESIZE_40_MS;
-          else if(strcmp(optarg,"60") == 0)
-            opt.framesize = OPUS_FRAMESIZE_60_MS;
-          else{
-            printf("--framesize must be one of the following: [2.5, 5, 10, 20, 40, 60].\n");
-            return 1;
-          }
+        if(error == 0){
+          break;
         }
-        else if(strcmp(opname, "auto-comment") == 0){ // add comments from input file
-          opt.auto_comment = true;
+        if(strcmp(opname, "cache") == 0){ // conversion manifest
+          opt.cache_path = optarg;
         }
-        else if(strcmp(opname, "artist") == 0){ // set artist tag
-          opt.artist = optarg;
+        else if(strcmp(opname, "album") == 0){ // one chained output
+          opt.album = optarg;
         }
-        else if(strcmp(opname, "title") == 0){ // set title tag
-          opt.title = optarg;
+        else if(strcmp(opname, "reuse-encoder") == 0){ // one encoder per worker
+          opt.reuse_encoder = true;
         }
-        else if(strcmp(opname, "date") == 0){ // set date tag
-          opt.date = optarg;
+        else if(strcmp(opname, "pcm-cache") == 0){ // rendered audio directory
+          opt.pcm_cache = optarg;
         }
-        else if(strcmp(opname, "repeat-count") == 0){ // plays n + 1 times
-          int32_t rc = atoi(optarg);
-          if(rc < 0){
-            printf("--repeat-count must be 0 (no loops) or n > 0 (play once and loop n times)\n");
+        else if(strcmp(opname, "stats") == 0){ // machine readable stats
+          if(strcmp(optarg, "json") != 0){
+            printf("--stats must be json\n");
             return 1;
           }
-          opt.repeat_count = rc;
+          opt.stats = true;
         }
-        else if(strcmp(opname, "gain") == 0){ // set gain in mB
-          opt.gain = atoi(optarg);
+        else if(strcmp(opname, "stats-file") == 0){ // where to write stats
+          opt.stats_path = optarg;
         }
-        else if(strcmp(opname, "interpolation") == 0){ // set interpolation filter preset
-          int32_t ifl = atoi(optarg);
-          if(ifl < 0){
-            printf("Interpolation value must be grater than 0, see --help for more\n");
+        else if(strcmp(opname, "serve") == 0){ // conversion daemon
+          serve_path = optarg;
+        }
+        else if(strcmp(opname, "scan") == 0){ // metadata listing
+          if(strcmp(optarg, "csv") == 0)
+            scan_format = SCAN_CSV;
+          else if(strcmp(optarg, "json") == 0)
+            scan_format = SCAN_JSON;
+          else{
+            printf("--scan must be one of the following: [csv, json].\n");
             return 1;
           }
-          opt.interpolation = ifl;
-        }
-        else if(strcmp(opname, "print-subsongs") == 0){ // print list of subsongs and numbers
-          opt.print_sub = true;
-        }
-        else if(strcmp(opname, "print-metadata") == 0){ // print song metadata
-          opt.print_meta = true;
-        }
-        else if(strcmp(opname, "dry-run") == 0){ // skips encoding to file
-          opt.dry_run = true;
         }
         else if(strcmp(opname, "supported") == 0){ // print list of supported files
           supported();
@@ -162,6 +274,13 @@ int main(int argc, char **argv){
       case 'q': // don't print
         opt.quiet = true;
         break;
+      case 'j': // number of files converted in parallel
+        opt.jobs = atoi(optarg);
+        if(opt.jobs < 1){
+          printf("--jobs must be 1 or greater\n");
+          return 1;
+        }
+        break;
       case '?': // option not recognized
         usage(argv[0]);
         return 1;
@@ -171,110 +290,65 @@ int main(int argc, char **argv){
   
   // Calculate required buffer size based on input values
   calc_buffer(&opt);
+  // Nothing is written on a dry run, so there is nothing to cache
+  if(opt.dry_run){
+    opt.cache_path = NULL;
+  }
+  // The complexity auto settles on depends on the load, so its output
+  // is not the same from run to run and can't be looked up
+  if(opt.complexity == MODOPUS_COMPLEXITY_AUTO){
+    opt.cache_path = NULL;
+  }
 
-  // Run for each input file.
-  while(optind < argc){
-    // Create openmpt module
-    char *filepath = argv[optind++];
-    char **split = split_path(filepath);
-    if(!validate_file(split)){
-      continue;
-    }
-    openmpt_module *mod = create_mod(filepath, opt);
-    if(mod == NULL){
-      free_split_path(split, 3);
-      continue;
-    }
-
-    // Print subsong and metadata info
-    if(opt.print_meta){
-      module_print_metadata(mod);
-    }
-    if(opt.print_sub){
-      module_print_subsongs(mod);
-    }
-    
-    // Moves onto the next file if dry run.
-    if(opt.dry_run){
-      openmpt_module_destroy(mod);
-      free_split_path(split, 3);
-      continue;
-    }
-
-    // Store comments settings in modopus_comments
-    modopus_comments comments;
-    init_comments(&comments);
-    // Auto comments
-    if(opt.auto_comment){
-      module_get_comments(mod,&comments);
-    }
-    // Adds user defined comments
-    if(opt.artist != NULL){
-      comments.artist = strdup(opt.artist);
-    }
-    if(opt.title != NULL){
-      comments.title = strdup(opt.title);
-    }
-    if(opt.date != NULL){
-      comments.date = strdup(opt.date);
-    }
-
-    char *outpath = NULL;
-    outpath = parse_filename(split); 
-    if(outpath == NULL){
-      clean_comments(&comments);
-      openmpt_module_destroy(mod);
-      free_split_path(split, 3);
-      continue;
+  if(scan_format != -1){
+    // Any module or directory that could not be read fails the scan
+    return run_scan(&argv[optind], argc - optind, scan_format, opt.jobs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if(serve_path != NULL){
+    opt.cache_path = NULL;
+    if(!validate_settings(&opt, stdout)){
+      return 1;
     }
+    return serve(serve_path, opt);
+  }
 
-    OggOpusComments *comm;
-    comm = create_opus_comments(comments);
-    if(comm == NULL){
-      free(outpath);
-      clean_comments(&comments);
-      openmpt_module_destroy(mod);
-      free_split_path(split, 3);
-      continue;
+  // Stream to stdout or a fifo. Multiple inputs follow each other as a
+  // chained Ogg stream, so they have to be converted one at a time.
+  struct stat st;
+  if(opt.album != NULL){
+    // The album is the one output, files are chained into it in order
+    opt.jobs = 1;
+    opt.cache_path = NULL;
+    if(strcmp(opt.album, "-") == 0){
+      opt.filename = opt.album;
+      opt.album = NULL;
+      opt.reuse_encoder = true;
     }
-    
-    OggOpusEnc *enc;
-    enc = create_opus_encoder(outpath, opt, comm);
-    if(enc == NULL){
-      free(outpath);
-      clean_comments(&comments);
-      openmpt_module_destroy(mod);
-      free_split_path(split, 3);
-      ope_comments_destroy(comm);
-      continue;
-    }
-  
-    if(!opt.quiet){
-      print_settings(filepath, outpath, opt);
-    }
-       
-    // Transfer pcm output from openmpt module to opus encoder
-    int error = convert_stream(mod, enc, opt);
-    if(error != 0){
-      free(outpath);
-      ope_encoder_destroy(enc);
-      ope_comments_destroy(comm);
-      openmpt_module_destroy(mod);
-      free_split_path(split, 3);
-      free(outpath);
-      clean_comments(&comments);
-      printf("failed\n");
-      continue;
+  }
+  if(strcmp(opt.filename, "-") == 0){
+    opt.output_stream = stdout;
+  }
+  else if(!opt.dry_run && stat(opt.filename, &st) == 0 && S_ISFIFO(st.st_mode)){
+    opt.output_stream = fopen(opt.filename, "wb");
+    if(opt.output_stream == NULL){
+      fprintf(stderr, "%s: %s\n", opt.filename, strerror(errno));
+      return 1;
     }
+  }
+  if(!validate_settings(&opt, stdout)){
+    return 1;
+  }
+  if(opt.output_stream != NULL){
+    opt.jobs = 1;
+    opt.cache_path = NULL;
+    // A closed reader shows up as a write error instead of killing us
+    signal(SIGPIPE, SIG_IGN);
+  }
 
-    // Cleanup
-    ope_encoder_drain(enc);
-    ope_encoder_destroy(enc);
-    ope_comments_destroy(comm);
-    openmpt_module_destroy(mod);
-    free_split_path(split, 3);
-    free(outpath);
-    clean_comments(&comments);
+  // Run for each input file.
+  run_batch(&argv[optind], argc - optind, opt);
+  if(opt.output_stream != NULL && opt.output_stream != stdout){
+    fclose(opt.output_stream);
   }
   exit(EXIT_SUCCESS);
 }
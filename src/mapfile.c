@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+
+/* Reads everything from fd into a malloc'd buffer.
+ * Used for pipes and other files that can't be mapped.
+ */
+static bool read_all(int fd, modopus_file *file){
+  size_t cap = 1 << 16;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  if(buf == NULL){
+    return false;
+  }
+  while(1){
+    if(len == cap){
+      char *tmp = realloc(buf, cap * 2);
+      if(tmp == NULL){
+        free(buf);
+        return false;
+      }
+      buf = tmp;
+      cap *= 2;
+    }
+    ssize_t n = read(fd, &buf[len], cap - len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0){
+      free(buf);
+      return false;
+    }
+    if(n == 0)
+      break;
+    len += n;
+  }
+  file->data = buf;
+  file->size = len;
+  file->mapped = false;
+  return true;
+}
+
+/* Maps the file at path into memory.
+ * param path path to input file
+ * param file set to the mapped contents, release with unmap_file
+ * return false if the file could not be opened or is empty
+ */
+bool map_file(const char *path, modopus_file *file){
+  int fd = open(path, O_RDONLY);
+  if(fd < 0){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  bool ok = false;
+  if(S_ISREG(st.st_mode) && st.st_size > 0){
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data != MAP_FAILED){
+      // libopenmpt probes the header and then mostly reads front to back
+      madvise(data, st.st_size, MADV_WILLNEED);
+      file->data = data;
+      file->size = st.st_size;
+      file->mapped = true;
+      ok = true;
+    }
+  }
+  if(!ok){
+    ok = read_all(fd, file);
+  }
+  close(fd);
+  if(!ok){
+    fprintf(stderr, "%s: failed reading file\n", path);
+    return false;
+  }
+  if(file->size == 0){
+    fprintf(stderr, "%s: file is empty\n", path);
+    unmap_file(file);
+    return false;
+  }
+  return true;
+}
+
+void unmap_file(modopus_file *file){
+  if(file->data == NULL){
+    return;
+  }
+  if(file->mapped){
+    munmap(file->data, file->size);
+  }
+  else{
+    free(file->data);
+  }
+  file->data = NULL;
+  file->size = 0;
+}
+
+/* Asks the kernel to start reading path in the background, so it is
+ * already cached when it is loaded. Errors are ignored.
+ */
+void prefetch_file(const char *path){
+  int fd = open(path, O_RDONLY | O_NONBLOCK);
+  if(fd < 0){
+    return;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  }
+  close(fd);
+}
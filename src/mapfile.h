@@ -0,0 +1,16 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+#include <stddef.h>
+#include <stdbool.h>
+
+// Contents of an input file, either memory mapped or read into memory
+typedef struct{
+  void *data;
+  size_t size;
+  bool mapped;
+}modopus_file;
+
+bool map_file(const char *, modopus_file *);
+void unmap_file(modopus_file *);
+void prefetch_file(const char *);
+#endif
@@ -4,34 +4,82 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <libopenmpt/libopenmpt.h>
 #include <libopenmpt/libopenmpt_stream_callbacks_file.h>
 #include <opusenc.h>
 
 #include "modopus.h"
+#include "ring.h"
+#include "mapfile.h"
+#include "stats.h"
+#include "pcmcache.h"
+#include "segment.h"
 
 // Setup modopus_settings to "default" values
 void init_settings(modopus_settings *opt){
   opt->framesize = OPUS_FRAMESIZE_20_MS;
   opt->samplerate = 48000;
+  opt->input_rate = 48000;
   opt->buffersize = 960;
   opt->repeat_count = 0;
   opt->interpolation = 0;
   opt->gain = 0;
+  opt->subsong = -1;
+  opt->channel = -1;
+  opt->complexity = -1;
+  opt->bitrate = OPUS_AUTO;
+  opt->bitrate_mode = MODOPUS_BITRATE_DEFAULT;
+  opt->sample_format = MODOPUS_FLOAT;
+  opt->target_rtf = 20;
+  opt->silence_threshold = -60;
+  opt->silence_hold = 2;
+  opt->normalize = 0;
+  opt->header_gain = 0;
+  opt->serialno = -1;
+  opt->lookahead = 0.2;
+  opt->clip_start = 0;
+  opt->clip_length = 0;
+  opt->fade_out = 0;
+  opt->segment_length = 0;
+  opt->segment_preroll = 2;
   opt->channels = 2;
+  opt->jobs = 1;
+  opt->ring_blocks = 16;
+  opt->ladder_count = 0;
   opt->filename = ""; 
+  opt->output_stream = NULL;
   opt->artist = NULL;
   opt->title = NULL;
   opt->date = NULL;
+  opt->cache_path = NULL;
+  opt->album = NULL;
+  opt->pcm_cache = NULL;
+  opt->stats_path = NULL;
   opt->auto_comment = false;
   opt->print_sub = false;
   opt->print_meta = false;
   opt->dry_run = false;
   opt->quiet = false; 
+  opt->pipeline = false;
+  opt->native_rate = false;
+  opt->reuse_encoder = false;
+  opt->all_subsongs = false;
+  opt->verify_segments = false;
+  opt->stems = false;
+  opt->trim_silence = false;
+  opt->stats = false;
+  opt->live = false;
+  opt->realtime = false;
 }
 
 void calc_buffer(modopus_settings *opt){
+  // Opus always runs at 48 kHz. Rendering at any other rate makes libopusenc
+  // resample again, so the requested rate is only recorded unless asked for.
+  opt->samplerate = opt->native_rate ? opt->input_rate : 48000;
   // Calculates buffersize based on framesize and samplerate.
   // For example, sample rate of 48 kHz and frame size of 20 ms results in a buffersize of 960. 
   switch (opt->framesize){
@@ -74,15 +122,28 @@ void clean_comments(modopus_comments *comments){
 
 
 
-void print_settings(const char *inpath, const char *outpath, const modopus_settings opt){
-    printf("Input:          %s\n",inpath);
-    printf("Output:         %s\n",outpath);
-    printf("Channels:       %d\n",opt.channels);
-    printf("Sample rate:    %d Hz\n",opt.samplerate);
-    printf("Play count:     %d + 1 times\n",opt.repeat_count);
-    printf("Gain:           %d mB\n",opt.gain);
-    printf("Interpolation:  %d\n",opt.interpolation);
-    printf("Auto comments:  %d\n\n",opt.auto_comment);
+void print_settings(FILE *out, const char *inpath, const char *outpath, const modopus_settings opt){
+    fprintf(out, "Input:          %s\n",inpath);
+    fprintf(out, "Output:         %s\n",outpath);
+    fprintf(out, "Channels:       %d\n",opt.channels);
+    if(opt.input_rate != opt.samplerate)
+      fprintf(out, "Sample rate:    %d Hz, input %d Hz\n",opt.samplerate,opt.input_rate);
+    else
+      fprintf(out, "Sample rate:    %d Hz\n",opt.samplerate);
+    fprintf(out, "Play count:     %d + 1 times\n",opt.repeat_count);
+    fprintf(out, "Gain:           %d mB\n",opt.gain);
+    fprintf(out, "Interpolation:  %d\n",opt.interpolation);
+    if(opt.channel >= 0)
+      fprintf(out, "Stem:           channel %d\n",opt.channel + 1);
+    if(opt.sample_format == MODOPUS_S16)
+      fprintf(out, "Sample format:  s16\n");
+    if(opt.complexity == MODOPUS_COMPLEXITY_AUTO)
+      fprintf(out, "Complexity:     auto (%gx realtime)\n",opt.target_rtf);
+    else if(opt.complexity >= 0)
+      fprintf(out, "Complexity:     %d\n",opt.complexity);
+    if(opt.bitrate != OPUS_AUTO)
+      fprintf(out, "Bitrate:        %d kbit/s\n",opt.bitrate / 1000);
+    fprintf(out, "Auto comments:  %d\n\n",opt.auto_comment);
 }
 
 /* Checks if input file can be opened in libopenmpt
@@ -99,6 +160,12 @@ bool validate_file(char **split_path){
   return false;
 }
 
+// Checks the extension quietly, most files in a tree or archive aren't modules
+bool has_module_extension(const char *name){
+  const char *dot = strrchr(name, '.');
+  return dot != NULL && dot[1] != '\0' && openmpt_is_extension_supported(&dot[1]);
+}
+
 /* Prints the list of supported file types.
  */
 void supported(void){
@@ -108,44 +175,27 @@ void supported(void){
 
 
 /* Creates an openmpt_module with proper (?) error handling
+ * The file is memory mapped and handed to libopenmpt in one piece.
  * param path path to input file
  * param opt options struct with values set
  */
 openmpt_module *create_mod(const char *path, const modopus_settings opt){
-  // Open input file and load to openmpt module
-  FILE *infile = NULL;
-  openmpt_module *mod = NULL;
-  
-  int error = OPENMPT_ERROR_OK;
-
-  infile = fopen(path, "rb");
-  if(infile == NULL){
-    fprintf(stderr, "%s: %s\n",path, strerror(errno));
-    return NULL;
-  }
-  mod = openmpt_module_create2(
-      openmpt_stream_get_file_callbacks(),
-      infile,
-      NULL,
-      NULL,
-      NULL,
-      NULL,
-      &error,
-      NULL,
-      NULL
-  );
-  fclose(infile);
-  if(mod == NULL){
-    fprintf(stderr, "%s: failed creating openmot_module\n",path);
+  modopus_file file;
+  if(!map_file(path, &file)){
     return NULL;
   }
+  // libopenmpt keeps its own copy of the file data
+  openmpt_module *mod = create_mod_from_memory(file.data, file.size, path, opt);
+  unmap_file(&file);
+  return mod;
+}
 
-  // Set render options for openmpt
-  error = openmpt_module_set_repeat_count(mod, opt.repeat_count);
+// Applies the render options of opt to a new module
+static bool set_render_params(openmpt_module *mod, const char *path, const modopus_settings opt){
+  int error = openmpt_module_set_repeat_count(mod, opt.repeat_count);
   if(error == 0){
     fprintf(stderr,"%s: failed setting repeat count\n",path);
-    openmpt_module_destroy(mod);
-    return NULL;
+    return false;
   }
   error = openmpt_module_set_render_param(
       mod,
@@ -154,8 +204,7 @@ openmpt_module *create_mod(const char *path, const modopus_settings opt){
   );
   if(error == 0){
     fprintf(stderr,"%s: failed setting interpolation param\n",path);
-    openmpt_module_destroy(mod);
-    return NULL;
+    return false;
   }
   error = openmpt_module_set_render_param(
       mod,
@@ -164,33 +213,206 @@ openmpt_module *create_mod(const char *path, const modopus_settings opt){
   );
   if(error == 0){
     fprintf(stderr,"%s: failed setting master gain\n",path);
+    return false;
+  }
+  return true;
+}
+
+/* Creates an openmpt_module from a file already in memory
+ * param data file contents
+ * param size size of data in bytes
+ * param path name used in error messages
+ * param opt options struct with values set
+ */
+openmpt_module *create_mod_from_memory(const void *data, size_t size, const char *path, const modopus_settings opt){
+  openmpt_module *mod = NULL;
+  int error = OPENMPT_ERROR_OK;
+  // Samples keep playing across seeks, for --segments
+  const openmpt_module_initial_ctl ctls[] = {
+    {"seek.sync_samples", "1"},
+    {NULL, NULL}
+  };
+
+  mod = openmpt_module_create_from_memory2(
+      data,
+      size,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      &error,
+      NULL,
+      ctls
+  );
+  if(mod == NULL){
+    fprintf(stderr, "%s: failed creating openmot_module\n",path);
+    return NULL;
+  }
+  if(!set_render_params(mod, path, opt)){
     openmpt_module_destroy(mod);
     return NULL;
   }
   return mod;
 }
 
-void module_print_metadata(openmpt_module *mod){
-  printf("Printing metadata:\n");
+/* Creates a module that renders a single channel, for --stems.
+ * The other channels are muted through the libopenmpt_ext interactive
+ * interface, so the mix is otherwise the same as the full render.
+ * param channel channel left audible
+ * return the module, destroy with openmpt_module_ext_destroy
+ */
+openmpt_module_ext *create_stem_from_memory(const void *data, size_t size, const char *path, int32_t channel, const modopus_settings opt){
+  int error = OPENMPT_ERROR_OK;
+  openmpt_module_ext *ext = openmpt_module_ext_create_from_memory(
+      data,
+      size,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      &error,
+      NULL,
+      NULL
+  );
+  if(ext == NULL){
+    fprintf(stderr, "%s: failed creating openmpt_module_ext\n", path);
+    return NULL;
+  }
+  openmpt_module *mod = openmpt_module_ext_get_module(ext);
+  openmpt_module_ext_interface_interactive interactive;
+  if(!set_render_params(mod, path, opt)){
+    openmpt_module_ext_destroy(ext);
+    return NULL;
+  }
+  if(!openmpt_module_ext_get_interface(ext, LIBOPENMPT_EXT_C_INTERFACE_INTERACTIVE, &interactive, sizeof(interactive))){
+    fprintf(stderr, "%s: libopenmpt has no interactive interface\n", path);
+    openmpt_module_ext_destroy(ext);
+    return NULL;
+  }
+  int32_t channels = openmpt_module_get_num_channels(mod);
+  for(int32_t i = 0; i < channels; i ++){
+    if(!interactive.set_channel_mute_status(ext, i, i != channel)){
+      fprintf(stderr, "%s: failed muting channel %d\n", path, i + 1);
+      openmpt_module_ext_destroy(ext);
+      return NULL;
+    }
+  }
+  return ext;
+}
+
+// Loads only what probe_mod needs from stream
+static openmpt_module *probe_stream(openmpt_stream_callbacks callbacks, void *stream){
+  const openmpt_module_initial_ctl ctls[] = {
+    {"load.skip_samples", "1"},
+    {"load.skip_plugins", "1"},
+    {NULL, NULL}
+  };
+  int error = OPENMPT_ERROR_OK;
+  return openmpt_module_create2(
+      callbacks,
+      stream,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      &error,
+      NULL,
+      ctls
+  );
+}
+
+/* Loads a module for reading its metadata and order list only.
+ * Sample and plugin data is skipped, which makes loading much cheaper,
+ * but the module can't be rendered.
+ * param path path to input file
+ * return the module, or NULL if it could not be loaded
+ */
+openmpt_module *probe_mod(const char *path){
+  FILE *infile = fopen(path, "rb");
+  if(infile == NULL){
+    return NULL;
+  }
+  openmpt_module *mod = probe_stream(openmpt_stream_get_file_callbacks(), infile);
+  fclose(infile);
+  return mod;
+}
+
+// Stream over a module in memory, such as a member of a mapped archive
+typedef struct{
+  const unsigned char *data;
+  size_t size;
+  size_t pos;
+}memory_stream;
+
+static size_t memory_read(void *stream, void *dst, size_t bytes){
+  memory_stream *ms = stream;
+  size_t count = ms->size - ms->pos < bytes ? ms->size - ms->pos : bytes;
+  memcpy(dst, &ms->data[ms->pos], count);
+  ms->pos += count;
+  return count;
+}
+
+static int memory_seek(void *stream, int64_t offset, int whence){
+  memory_stream *ms = stream;
+  int64_t base = whence == OPENMPT_STREAM_SEEK_SET ? 0 : whence == OPENMPT_STREAM_SEEK_CUR ? (int64_t)ms->pos : (int64_t)ms->size;
+  if(base + offset < 0 || base + offset > (int64_t)ms->size){
+    return -1;
+  }
+  ms->pos = base + offset;
+  return 0;
+}
+
+static int64_t memory_tell(void *stream){
+  return ((memory_stream *)stream)->pos;
+}
+
+/* Same as probe_mod, for a module that is already in memory.
+ * libopenmpt reads the parts it needs through stream callbacks, so the
+ * sample data is never copied.
+ */
+openmpt_module *probe_mod_memory(const void *data, size_t size){
+  memory_stream ms = {data, size, 0};
+  const openmpt_stream_callbacks callbacks = {memory_read, memory_seek, memory_tell};
+  return probe_stream(callbacks, &ms);
+}
+
+/* Estimates the play time of a module without keeping it loaded.
+ * param path path to input file
+ * return duration in seconds, or -1 if the file could not be loaded
+ */
+double module_probe_duration(const char *path){
+  openmpt_module *mod = probe_mod(path);
+  if(mod == NULL){
+    return -1;
+  }
+  double duration = openmpt_module_get_duration_seconds(mod);
+  openmpt_module_destroy(mod);
+  return duration;
+}
+
+void module_print_metadata(FILE *out, openmpt_module *mod){
+  fprintf(out, "Printing metadata:\n");
   const char *tmp = openmpt_module_get_metadata_keys(mod);
   char *keys = strdup(tmp);
-  char *key = strtok(keys, ";");
+  // Workers print metadata at the same time, strtok would share its state
+  char *saveptr = NULL;
+  char *key = strtok_r(keys, ";", &saveptr);
   while(key != NULL){
     const char *data = openmpt_module_get_metadata(mod, key);
-    printf("%s:\"%s\"\n",key,data);
+    fprintf(out, "%s:\"%s\"\n",key,data);
     free((char *)data);
-    key = strtok(NULL,";");
+    key = strtok_r(NULL, ";", &saveptr);
   }
   free(keys);
   free((char *)tmp);
 }
 
-void module_print_subsongs(openmpt_module *mod){
-  printf("Printing subsong data:\n");
+void module_print_subsongs(FILE *out, openmpt_module *mod){
+  fprintf(out, "Printing subsong data:\n");
   int32_t num_subsongs = openmpt_module_get_num_subsongs(mod);
   for(int i = 0; i < num_subsongs; i ++){
     const char *subsong_name = openmpt_module_get_subsong_name(mod,i); 
-    printf("%d: %s\n",i,subsong_name);
+    fprintf(out, "%d: %s\n",i,subsong_name);
     free((char *)subsong_name);
   }
 }
@@ -230,31 +452,798 @@ OggOpusComments *create_opus_comments(const modopus_comments comments){
   return comm;
 }
 
+/* Sets complexity, bitrate and bitrate mode from a named preset.
+ * preview also cuts a short clip from the most active part of the song.
+ * Options given after the preset override it.
+ * return false if name isn't a preset
+ */
+bool apply_preset(modopus_settings *opt, const char *name){
+  if(strcmp(name, "fast") == 0){
+    opt->complexity = 2;
+    opt->bitrate_mode = MODOPUS_VBR;
+  }
+  else if(strcmp(name, "balanced") == 0){
+    opt->complexity = 5;
+    opt->bitrate_mode = MODOPUS_VBR;
+  }
+  else if(strcmp(name, "archive") == 0){
+    opt->complexity = 10;
+    opt->bitrate = 160000;
+    opt->bitrate_mode = MODOPUS_VBR;
+  }
+  else if(strcmp(name, "preview") == 0){
+    opt->complexity = 5;
+    opt->bitrate = 48000;
+    opt->bitrate_mode = MODOPUS_VBR;
+    opt->clip_start = MODOPUS_START_LOUDEST;
+    opt->clip_length = 30;
+    opt->fade_out = 3;
+  }
+  else{
+    return false;
+  }
+  return true;
+}
+
+/* Channel mapping family for the Opus header.
+ * Family 0 only covers mono and stereo, quad uses the Vorbis channel
+ * order of family 1, which matches libopenmpt's quad output.
+ */
+static int mapping_family(const modopus_settings opt){
+  return opt.channels > 2 ? 1 : 0;
+}
+
+/* Passes frame size, complexity and bitrate settings on to libopus.
+ * Controls left at their defaults aren't touched.
+ */
+static bool apply_encoder_settings(OggOpusEnc *enc, const modopus_settings opt){
+  int error = ope_encoder_ctl(enc, OPUS_SET_EXPERT_FRAME_DURATION(opt.framesize));
+  if(error == OPE_OK && opt.complexity != -1){
+    // Auto starts from the top and is lowered while converting
+    int complexity = opt.complexity == MODOPUS_COMPLEXITY_AUTO ? 10 : opt.complexity;
+    error = ope_encoder_ctl(enc, OPUS_SET_COMPLEXITY(complexity));
+  }
+  if(error == OPE_OK && opt.normalize != 0){
+    error = ope_encoder_ctl(enc, OPE_SET_HEADER_GAIN(opt.header_gain));
+  }
+  if(error == OPE_OK && opt.serialno >= 0){
+    error = ope_encoder_ctl(enc, OPE_SET_SERIALNO((opus_int32)(uint32_t)opt.serialno));
+  }
+  if(error == OPE_OK && opt.live){
+    // Encode each block as it comes and put it on a page of its own
+    error = ope_encoder_ctl(enc, OPE_SET_DECISION_DELAY(0));
+    if(error == OPE_OK){
+      error = ope_encoder_ctl(enc, OPE_SET_MUXING_DELAY((opus_int32)(opt.buffersize * 48000 / opt.samplerate)));
+    }
+  }
+  if(error == OPE_OK && opt.bitrate != OPUS_AUTO){
+    error = ope_encoder_ctl(enc, OPUS_SET_BITRATE(opt.bitrate));
+  }
+  if(error == OPE_OK && opt.bitrate_mode != MODOPUS_BITRATE_DEFAULT){
+    error = ope_encoder_ctl(enc, OPUS_SET_VBR(opt.bitrate_mode != MODOPUS_HARD_CBR));
+    if(error == OPE_OK && opt.bitrate_mode != MODOPUS_HARD_CBR){
+      error = ope_encoder_ctl(enc, OPUS_SET_VBR_CONSTRAINT(opt.bitrate_mode == MODOPUS_CVBR));
+    }
+  }
+  if(error != OPE_OK){
+    fprintf(stderr, "Failed setting encoder options: %s\n", ope_strerror(error));
+    return false;
+  }
+  return true;
+}
+
 OggOpusEnc *create_opus_encoder(const char *outpath, const modopus_settings opt, OggOpusComments *comm){
   int error = OPE_OK;
-  OggOpusEnc *enc = ope_encoder_create_file(outpath, comm, opt.samplerate, opt.channels, 0, &error);
+  OggOpusEnc *enc = ope_encoder_create_file(outpath, comm, opt.samplerate, opt.channels, mapping_family(opt), &error);
   if(error != OPE_OK){
     fprintf(stderr, "Failed creating opus encoder\n");
     return NULL;
   }
+  if(!apply_encoder_settings(enc, opt)){
+    ope_encoder_destroy(enc);
+    return NULL;
+  }
   return enc;
 }
 
-int convert_stream(openmpt_module *mod, OggOpusEnc *enc, const modopus_settings opt){
-  // Reads the input file and sends pcm data to encoder, in increments of buffersize. 
-  // Buffer stores interleaved pcm data
-  float buffer[opt.buffersize * 2];
+// Resets clock for a new stream, before its encoder is created or continued
+void live_clock_start(live_clock *clock){
+  clock->start = monotonic_seconds();
+  clock->first_audio = -1;
+  clock->waiting = true;
+  clock->fed = 0;
+  clock->mark_head = 0;
+  clock->mark_count = 0;
+  clock->latency_sum = 0;
+  clock->latency_max = 0;
+  clock->pages = 0;
+}
+
+// Marks a block as handed to the encoder, before libopusenc sees it
+static void live_clock_feed(live_clock *clock, size_t frames, int32_t samplerate){
+  clock->fed += (uint64_t)frames * 48000 / samplerate;
+  if(clock->mark_count == MODOPUS_LIVE_MARKS){
+    // The oldest block is long overdue, it isn't measured
+    clock->mark_head = (clock->mark_head + 1) % MODOPUS_LIVE_MARKS;
+    clock->mark_count --;
+  }
+  size_t i = (clock->mark_head + clock->mark_count) % MODOPUS_LIVE_MARKS;
+  clock->mark_samples[i] = clock->fed;
+  clock->mark_time[i] = monotonic_seconds();
+  clock->mark_count ++;
+}
+
+static uint64_t read_le(const unsigned char *p, int bytes){
+  uint64_t v = 0;
+  for(int i = bytes - 1; i >= 0; i --){
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+/* Times an Ogg page on its way out. libopusenc hands the sink whole
+ * pages, the granule position tells up to which sample a page reaches.
+ */
+static void live_clock_page(live_clock *clock, const unsigned char *page, size_t len){
+  if(len < 27 || memcmp(page, "OggS", 4) != 0 || len < 27 + (size_t)page[26]){
+    return;
+  }
+  uint32_t serial = read_le(&page[14], 4);
+  const unsigned char *body = &page[27 + page[26]];
+  size_t body_len = len - 27 - page[26];
+  if(page[5] & 0x02){
+    if(body_len >= 19 && memcmp(body, "OpusHead", 8) == 0){
+      clock->serial = serial;
+      clock->preskip = read_le(&body[10], 2);
+      clock->waiting = false;
+    }
+    return;
+  }
+  uint64_t granule = read_le(&page[6], 8);
+  if(clock->waiting || serial != clock->serial || granule == UINT64_MAX || granule <= clock->preskip){
+    return;
+  }
+  double now = monotonic_seconds();
+  if(clock->first_audio < 0){
+    clock->first_audio = now - clock->start;
+  }
+  // Blocks that end on this page are done, the page is as late as the last one
+  uint64_t end = granule - clock->preskip;
+  double fed_at = -1;
+  while(clock->mark_count > 0 && clock->mark_samples[clock->mark_head] <= end){
+    fed_at = clock->mark_time[clock->mark_head];
+    clock->mark_head = (clock->mark_head + 1) % MODOPUS_LIVE_MARKS;
+    clock->mark_count --;
+  }
+  if(fed_at < 0 && clock->mark_count > 0){
+    fed_at = clock->mark_time[clock->mark_head];
+  }
+  if(fed_at >= 0){
+    double latency = now - fed_at;
+    clock->latency_sum += latency;
+    clock->latency_max = latency > clock->latency_max ? latency : clock->latency_max;
+    clock->pages ++;
+  }
+}
+
+static int sink_write(void *user_data, const unsigned char *ptr, opus_int32 len){
+  modopus_sink *sink = user_data;
+  if(fwrite(ptr, 1, len, sink->file) != (size_t)len){
+    return 1;
+  }
+  sink->bytes += len;
+  if(sink->clock != NULL){
+    // Pages go out as they are made instead of waiting in the stdio buffer
+    if(fflush(sink->file) != 0){
+      return 1;
+    }
+    live_clock_page(sink->clock, ptr, len);
+  }
+  return 0;
+}
+
+static int sink_close(void *user_data){
+  // The stream outlives the encoder, it is shared by every input
+  modopus_sink *sink = user_data;
+  return fflush(sink->file) != 0;
+}
+
+/* Creates an encoder that writes Ogg pages to an already open stream,
+ * such as stdout or a fifo, instead of a file it opens itself.
+ * param sink destination, must stay valid until the encoder is destroyed
+ */
+OggOpusEnc *create_opus_stream_encoder(modopus_sink *sink, const modopus_settings opt, OggOpusComments *comm){
   int error = OPE_OK;
+  const OpusEncCallbacks callbacks = {sink_write, sink_close};
+  OggOpusEnc *enc = ope_encoder_create_callbacks(&callbacks, sink, comm, opt.samplerate, opt.channels, mapping_family(opt), &error);
+  if(error != OPE_OK){
+    fprintf(stderr, "Failed creating opus encoder\n");
+    return NULL;
+  }
+  if(!apply_encoder_settings(enc, opt)){
+    ope_encoder_destroy(enc);
+    return NULL;
+  }
+  // Listeners can set up their decoder before the first audio is ready
+  if(opt.live && ope_encoder_flush_header(enc) != OPE_OK){
+    fprintf(stderr, "Failed writing opus headers\n");
+    ope_encoder_destroy(enc);
+    return NULL;
+  }
+  return enc;
+}
+
+/* Ends the current output of an encoder and starts the next one with
+ * comm, keeping the encoder state. Settings are applied again, so a
+ * reused encoder starts each file like a new one would.
+ * param outpath file for the next output, NULL to chain the next stream
+ *        into the current output, which makes the files play gaplessly
+ */
+bool continue_opus_encoder(OggOpusEnc *enc, const char *outpath, const modopus_settings opt, OggOpusComments *comm){
+  int error;
+  if(outpath != NULL){
+    error = ope_encoder_continue_new_file(enc, outpath, comm);
+  }
+  else{
+    error = ope_encoder_chain_current(enc, comm);
+  }
+  if(error != OPE_OK){
+    fprintf(stderr, "Failed starting the next opus stream: %s\n", ope_strerror(error));
+    return false;
+  }
+  return apply_encoder_settings(enc, opt);
+}
+
+#define TUNE_WINDOW 0.5
+#define TUNE_SECONDS 6.0
+
+/* Picks the complexity for MODOPUS_COMPLEXITY_AUTO on the first seconds
+ * of a stream. The encoder starts at 10 and steps down after every
+ * window of audio that was converted slower than the target.
+ */
+typedef struct{
+  bool active;
+  int complexity;
+  double audio;  // seconds of audio in the current window
+  double busy;   // seconds spent converting the current window
+  double probed; // seconds of audio probed so far
+}complexity_tuner;
+
+static void tuner_init(complexity_tuner *tuner, const modopus_settings opt){
+  tuner->active = opt.complexity == MODOPUS_COMPLEXITY_AUTO;
+  tuner->complexity = tuner->active ? 10 : opt.complexity;
+  tuner->audio = 0;
+  tuner->busy = 0;
+  tuner->probed = 0;
+}
+
+/* Adds a converted block to the current window.
+ * param frames frames in the block
+ * param busy seconds spent on the part that limits throughput
+ */
+static void tuner_update(complexity_tuner *tuner, OggOpusEnc *enc, const modopus_settings opt, size_t frames, double busy){
+  if(!tuner->active){
+    return;
+  }
+  tuner->audio += (double)frames / opt.samplerate;
+  tuner->busy += busy;
+  if(tuner->audio < TUNE_WINDOW){
+    return;
+  }
+  tuner->probed += tuner->audio;
+  bool slow = tuner->audio < opt.target_rtf * tuner->busy;
+  tuner->audio = 0;
+  tuner->busy = 0;
+  if(slow && tuner->complexity > 0){
+    tuner->complexity --;
+    ope_encoder_ctl(enc, OPUS_SET_COMPLEXITY(tuner->complexity));
+  }
+  else{
+    tuner->active = false;
+  }
+  if(tuner->probed >= TUNE_SECONDS){
+    tuner->active = false;
+  }
+}
+
+/* Settings of one --ladder output.
+ * The buffersize stays that of opt, as all rungs share the rendered blocks.
+ * param rung index into opt.ladder
+ */
+modopus_settings rung_settings(const modopus_settings opt, int rung){
+  modopus_settings out = opt;
+  out.bitrate = opt.ladder[rung].bitrate;
+  if(opt.ladder[rung].framesize != 0){
+    out.framesize = opt.ladder[rung].framesize;
+  }
+  out.ladder_count = 0;
+  return out;
+}
+
+// Size of one sample in opt.sample_format
+size_t sample_bytes(const modopus_settings opt){
+  return opt.sample_format == MODOPUS_S16 ? sizeof(int16_t) : sizeof(float);
+}
+
+/* Renders the next block with the libopenmpt reader for opt.channels
+ * and opt.sample_format.
+ * param buffer room for opt.buffersize * opt.channels samples
+ * return frames rendered, 0 at the end of the song
+ */
+size_t render_block(openmpt_module *mod, const modopus_settings opt, void *buffer){
+  if(opt.sample_format == MODOPUS_S16){
+    switch(opt.channels){
+      case 1:
+        return openmpt_module_read_mono(mod, opt.samplerate, opt.buffersize, buffer);
+      case 4:
+        return openmpt_module_read_interleaved_quad(mod, opt.samplerate, opt.buffersize, buffer);
+      default:
+        return openmpt_module_read_interleaved_stereo(mod, opt.samplerate, opt.buffersize, buffer);
+    }
+  }
+  switch(opt.channels){
+    case 1:
+      return openmpt_module_read_float_mono(mod, opt.samplerate, opt.buffersize, buffer);
+    case 4:
+      return openmpt_module_read_interleaved_float_quad(mod, opt.samplerate, opt.buffersize, buffer);
+    default:
+      return openmpt_module_read_interleaved_float_stereo(mod, opt.samplerate, opt.buffersize, buffer);
+  }
+}
+
+// Sets up a source rendering mod, without cached audio or recording
+void init_source(modopus_source *src, openmpt_module *mod){
+  src->mod = mod;
+  src->pcm = NULL;
+  src->pcm_frames = 0;
+  src->pcm_pos = 0;
+  src->record = NULL;
+  src->segments = NULL;
+  src->clip_left = SIZE_MAX;
+  src->fade_frames = 0;
+  src->ended = false;
+}
+
+/* Fades out the frames of a block that fall in the last
+ * src->fade_frames of a clip, linearly down to silence.
+ */
+static void fade_block(const modopus_source *src, const modopus_settings opt, void *buffer, size_t count){
+  for(size_t i = 0; i < count; i ++){
+    size_t left = src->clip_left - i;
+    if(left > src->fade_frames){
+      continue;
+    }
+    float gain = (float)left / (src->fade_frames + 1);
+    for(int c = 0; c < opt.channels; c ++){
+      size_t n = i * opt.channels + c;
+      if(opt.sample_format == MODOPUS_S16){
+        ((int16_t *)buffer)[n] = (int16_t)lrintf(((int16_t *)buffer)[n] * gain);
+      }
+      else{
+        ((float *)buffer)[n] *= gain;
+      }
+    }
+  }
+}
+
+/* Reads the next block, from the pcm cache if src has cached audio,
+ * or from the segments rendered ahead with --segments.
+ * A --duration clip ends after src->clip_left frames, faded out.
+ * Rendered blocks are also appended to src->record.
+ * The pcm cache holds floats, it is only used with MODOPUS_FLOAT.
+ * param buffer room for opt.buffersize * opt.channels samples
+ * return frames read, 0 at the end of the song
+ */
+size_t source_read(modopus_source *src, const modopus_settings opt, void *buffer){
+  size_t count;
+  if(src->clip_left == 0){
+    count = 0;
+  }
+  else if(src->pcm != NULL){
+    count = src->pcm_frames - src->pcm_pos;
+    if(count > opt.buffersize){
+      count = opt.buffersize;
+    }
+    memcpy(buffer, &src->pcm[src->pcm_pos * opt.channels], count * opt.channels * sizeof(float));
+    src->pcm_pos += count;
+  }
+  else if(src->segments != NULL){
+    count = segments_read(src->segments, opt, buffer);
+  }
+  else{
+    count = render_block(src->mod, opt, buffer);
+    if(src->record != NULL && count > 0){
+      pcm_record_write(src->record, buffer, count, opt.channels);
+    }
+  }
+  if(src->clip_left != SIZE_MAX){
+    count = count < src->clip_left ? count : src->clip_left;
+    fade_block(src, opt, buffer, count);
+    src->clip_left -= count;
+  }
+  src->ended = count == 0;
+  return count;
+}
+
+/* Silence detection for --trim-silence.
+ * Leading silence is dropped. Silence after the first sound is held back
+ * until either sound returns, and it is written out, or it lasts
+ * opt.silence_hold seconds, and the stream ends there.
+ */
+typedef struct{
+  bool enabled;
+  bool started;   // a frame above the threshold has been seen
+  float threshold;
+  size_t hold;    // frames of silence that end the stream
+  unsigned char *pending; // silent frames held back since the last sound
+  size_t pending_frames;
+  size_t lead_trimmed;
+}silence_gate;
+
+// Encoding side of convert_stream, shared by the serial and pipelined loops
+typedef struct{
+  OggOpusEnc *enc;
+  modopus_settings opt;
+  complexity_tuner tuner;
+  silence_gate gate;
+  live_clock *clock; // --live timing, or NULL
+  double start;      // wall clock time --realtime paces from
+  double encode_time;
+  size_t frames;
+  bool failed;
+  bool finished;
+}stream_writer;
+
+static bool writer_init(stream_writer *writer, OggOpusEnc *enc, live_clock *clock, const modopus_settings opt){
+  writer->enc = enc;
+  writer->opt = opt;
+  tuner_init(&writer->tuner, opt);
+  writer->clock = clock;
+  writer->start = monotonic_seconds();
+  writer->encode_time = 0;
+  writer->frames = 0;
+  writer->failed = false;
+  writer->finished = false;
+  silence_gate *gate = &writer->gate;
+  gate->enabled = opt.trim_silence;
+  gate->started = false;
+  gate->threshold = powf(10, opt.silence_threshold / 20);
+  gate->hold = (size_t)(opt.silence_hold * opt.samplerate);
+  gate->pending = NULL;
+  gate->pending_frames = 0;
+  gate->lead_trimmed = 0;
+  if(gate->enabled){
+    // The hold is checked once per block, so it can overshoot by a block
+    gate->pending = malloc((gate->hold + opt.buffersize) * opt.channels * sample_bytes(opt));
+    if(gate->pending == NULL){
+      fprintf(stderr, "Failed allocating memory\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Passes frames to libopusenc, keeping time for stats and the tuner
+static bool writer_encode(stream_writer *writer, const void *pcm, size_t frames){
+  if(frames == 0){
+    return true;
+  }
+  if(writer->clock != NULL){
+    live_clock_feed(writer->clock, frames, writer->opt.samplerate);
+  }
+  double start = monotonic_seconds();
+  int error;
+  if(writer->opt.sample_format == MODOPUS_S16){
+    error = ope_encoder_write(writer->enc, pcm, frames);
+  }
+  else{
+    error = ope_encoder_write_float(writer->enc, pcm, frames);
+  }
+  writer->encode_time += monotonic_seconds() - start;
+  if(error != OPE_OK){
+    fprintf(stderr, "Failed writing opus data\n");
+    writer->failed = true;
+    return false;
+  }
+  writer->frames += frames;
+  return true;
+}
+
+static bool frame_is_silent(const void *frame, const modopus_settings opt, float threshold){
+  for(int c = 0; c < opt.channels; c ++){
+    float level = opt.sample_format == MODOPUS_S16 ? ((const int16_t *)frame)[c] / 32768.0f : ((const float *)frame)[c];
+    if(fabsf(level) > threshold){
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Runs a block through the silence gate to the encoder.
+ * return false when the stream should stop, see writer->failed
+ */
+static bool gate_write(stream_writer *writer, const void *pcm, size_t count){
+  silence_gate *gate = &writer->gate;
+  const unsigned char *block = pcm;
+  size_t frame = writer->opt.channels * sample_bytes(writer->opt);
+  size_t first = 0;
+  if(!gate->started){
+    while(first < count && frame_is_silent(&block[first * frame], writer->opt, gate->threshold)){
+      first ++;
+    }
+    gate->lead_trimmed += first;
+    if(first == count){
+      return true;
+    }
+    gate->started = true;
+  }
+  size_t end = count;
+  while(end > first && frame_is_silent(&block[(end - 1) * frame], writer->opt, gate->threshold)){
+    end --;
+  }
+  if(end > first){
+    // Sound again, the held back silence belongs to the song
+    if(!writer_encode(writer, gate->pending, gate->pending_frames)
+        || !writer_encode(writer, &block[first * frame], end - first)){
+      return false;
+    }
+    gate->pending_frames = 0;
+    first = end;
+  }
+  memcpy(&gate->pending[gate->pending_frames * frame], &block[first * frame], (count - first) * frame);
+  gate->pending_frames += count - first;
+  return gate->pending_frames < gate->hold;
+}
+
+// Holds the stream back until it is at most opt.lookahead ahead of playback
+static void writer_pace(stream_writer *writer){
+  double due = writer->start + (double)writer->frames / writer->opt.samplerate - writer->opt.lookahead;
+  double wait = due - monotonic_seconds();
+  if(wait > 0){
+    struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+    while(nanosleep(&ts, &ts) != 0 && errno == EINTR);
+  }
+}
+
+/* Sends a rendered block on to the encoder.
+ * param busy seconds spent producing the block that limit throughput
+ * return false when the stream should stop, see writer->failed
+ */
+static bool writer_write(stream_writer *writer, const void *block, size_t count, double busy){
+  if(writer->opt.realtime){
+    writer_pace(writer);
+  }
+  double encode_time = writer->encode_time;
+  bool more;
+  if(writer->gate.enabled){
+    more = gate_write(writer, block, count);
+  }
+  else{
+    more = writer_encode(writer, block, count);
+  }
+  tuner_update(&writer->tuner, writer->enc, writer->opt, count, busy + writer->encode_time - encode_time);
+  writer->finished = !more && !writer->failed;
+  return more;
+}
+
+// Drops the trailing silence still held back and fills in stats
+static void writer_finish(stream_writer *writer, modopus_stats *stats){
+  if(stats != NULL){
+    stats->frames += writer->frames;
+    stats->encode_time += writer->encode_time;
+    stats->complexity = writer->tuner.complexity;
+    stats->lead_trimmed += writer->gate.lead_trimmed;
+    stats->tail_trimmed += writer->gate.pending_frames;
+    if(writer->clock != NULL){
+      stats->first_audio = writer->clock->first_audio;
+      stats->latency_avg = writer->clock->pages > 0 ? writer->clock->latency_sum / writer->clock->pages : 0;
+      stats->latency_max = writer->clock->latency_max;
+    }
+  }
+  free(writer->gate.pending);
+  writer->gate.pending = NULL;
+}
+
+// Arguments for the render thread of convert_stream_pipelined
+typedef struct{
+  modopus_source *src;
+  modopus_ring *ring;
+  modopus_settings opt;
+  double render_time;
+}render_args;
+
+static void *render_thread(void *arg){
+  render_args *args = arg;
+  while(1){
+    void *block = ring_acquire_write(args->ring);
+    if(block == NULL)
+      break;
+    double start = monotonic_seconds();
+    size_t count = source_read(args->src, args->opt, block);
+    args->render_time += monotonic_seconds() - start;
+    if(count == 0)
+      break;
+    ring_commit_write(args->ring, count);
+  }
+  ring_close(args->ring);
+  return NULL;
+}
+
+/* Same as convert_stream, but libopenmpt renders on its own thread while
+ * the calling thread encodes. Blocks are passed through a ring of
+ * opt.ring_blocks buffers.
+ */
+static int convert_stream_pipelined(modopus_source *src, stream_writer *writer, const modopus_settings opt, modopus_stats *stats){
+  modopus_ring ring;
+  if(!ring_init(&ring, opt.ring_blocks, opt.buffersize * opt.channels * sample_bytes(opt))){
+    return 1;
+  }
+  render_args args = {src, &ring, opt, 0};
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, render_thread, &args) != 0){
+    fprintf(stderr, "Failed creating render thread\n");
+    ring_free(&ring);
+    return 1;
+  }
+  const void *block;
+  size_t count = 0;
+  while((block = ring_acquire_read(&ring, &count)) != NULL){
+    // Rendering runs alongside, so only encoding limits throughput
+    bool more = writer_write(writer, block, count, 0);
+    ring_commit_read(&ring);
+    if(!more){
+      ring_abort(&ring);
+      break;
+    }
+  }
+  pthread_join(thread, NULL);
+  if(stats != NULL){
+    stats->render_stalls = ring.producer_stalls;
+    stats->encode_stalls = ring.consumer_stalls;
+    stats->render_time += args.render_time;
+  }
+  ring_free(&ring);
+  return writer->failed;
+}
+
+/* Converts src with enc, until the song ends or the silence gate stops it.
+ * param clock timing of a --live stream, or NULL
+ * return 0 on success, 1 on failure
+ */
+int convert_stream(modopus_source *src, OggOpusEnc *enc, live_clock *clock, const modopus_settings opt, modopus_stats *stats){
+  stream_writer writer;
+  if(!writer_init(&writer, enc, clock, opt)){
+    return 1;
+  }
+  if(opt.pipeline){
+    int error = convert_stream_pipelined(src, &writer, opt, stats);
+    writer_finish(&writer, stats);
+    return error;
+  }
+  // Reads the input file and sends pcm data to encoder, in increments of buffersize. 
+  // Buffer stores interleaved pcm data, sized for floats, the larger sample format
+  float buffer[opt.buffersize * opt.channels];
+  double render_time = 0;
   while(1){
     size_t count = 0;
-    count = openmpt_module_read_interleaved_float_stereo(mod, opt.samplerate, opt.buffersize, buffer);
+    double start = monotonic_seconds();
+    count = source_read(src, opt, buffer);
+    double rendered = monotonic_seconds() - start;
+    render_time += rendered;
     if(count == 0)
       break;
-    error = ope_encoder_write_float(enc, buffer, count);
-    if(error != OPE_OK){
-      fprintf(stderr, "Failed writing opus data\n");
-      return 1;
+    if(!writer_write(&writer, buffer, count, rendered))
+      break;
+  }
+  if(stats != NULL){
+    stats->render_time += render_time;
+  }
+  writer_finish(&writer, stats);
+  return writer.failed;
+}
+
+// One encoder of convert_stream_ladder and the ring feeding it
+typedef struct{
+  stream_writer writer;
+  modopus_ring ring;
+  pthread_t thread;
+  bool done;     // the encoder stopped taking blocks
+}ladder_rung;
+
+static void *encode_thread(void *arg){
+  ladder_rung *rung = arg;
+  const void *block;
+  size_t count = 0;
+  while((block = ring_acquire_read(&rung->ring, &count)) != NULL){
+    bool more = writer_write(&rung->writer, block, count, 0);
+    ring_commit_read(&rung->ring);
+    if(!more){
+      ring_abort(&rung->ring);
+      break;
     }
   }
-  return 0;
+  return NULL;
+}
+
+/* Renders the module once and encodes it with every --ladder encoder.
+ * Each encoder runs on its own thread, fed through its own ring, while
+ * the calling thread renders and copies every block to all rings.
+ * param encs opt.ladder_count encoders, in --ladder order
+ * return 0 if every encoder succeeded
+ */
+int convert_stream_ladder(modopus_source *src, OggOpusEnc **encs, const modopus_settings opt, modopus_stats *stats){
+  int count = opt.ladder_count;
+  ladder_rung *rungs = calloc(count, sizeof(ladder_rung));
+  if(rungs == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return 1;
+  }
+  size_t block_len = opt.buffersize * opt.channels;
+  size_t frame_bytes = opt.channels * sample_bytes(opt);
+  int started = 0;
+  bool failed = false;
+  for(; started < count; started ++){
+    ladder_rung *rung = &rungs[started];
+    if(!ring_init(&rung->ring, opt.ring_blocks, opt.buffersize * frame_bytes)){
+      failed = true;
+      break;
+    }
+    if(!writer_init(&rung->writer, encs[started], NULL, rung_settings(opt, started))){
+      ring_free(&rung->ring);
+      failed = true;
+      break;
+    }
+    if(pthread_create(&rung->thread, NULL, encode_thread, rung) != 0){
+      fprintf(stderr, "Failed creating encoder thread\n");
+      writer_finish(&rung->writer, NULL);
+      ring_free(&rung->ring);
+      failed = true;
+      break;
+    }
+  }
+
+  // Sized for floats, the larger sample format
+  float buffer[block_len];
+  double render_time = 0;
+  int open = started;
+  while(!failed && open > 0){
+    double start = monotonic_seconds();
+    size_t frames = source_read(src, opt, buffer);
+    render_time += monotonic_seconds() - start;
+    if(frames == 0)
+      break;
+    for(int i = 0; i < started; i ++){
+      if(rungs[i].done)
+        continue;
+      void *slot = ring_acquire_write(&rungs[i].ring);
+      if(slot == NULL){
+        rungs[i].done = true;
+        open --;
+        continue;
+      }
+      memcpy(slot, buffer, frames * frame_bytes);
+      ring_commit_write(&rungs[i].ring, frames);
+    }
+  }
+
+  for(int i = 0; i < started; i ++){
+    ring_close(&rungs[i].ring);
+    pthread_join(rungs[i].thread, NULL);
+    failed |= rungs[i].writer.failed;
+    if(stats != NULL){
+      // The first rung stands for the song, encode time covers them all
+      stats->render_stalls += rungs[i].ring.producer_stalls;
+      stats->encode_stalls += rungs[i].ring.consumer_stalls;
+      if(i > 0){
+        stats->encode_time += rungs[i].writer.encode_time;
+      }
+    }
+    writer_finish(&rungs[i].writer, i == 0 ? stats : NULL);
+    ring_free(&rungs[i].ring);
+  }
+  if(stats != NULL){
+    stats->render_time += render_time;
+  }
+  free(rungs);
+  return failed;
 }
@@ -1,29 +1,161 @@
 #ifndef MODCONV_H
 #define MODCONV_H
+#include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <opusenc.h>
 
 #include <libopenmpt/libopenmpt.h>
+#include <libopenmpt/libopenmpt_ext.h>
+
+// Bitrate management, MODOPUS_BITRATE_DEFAULT leaves libopus in charge
+enum{
+  MODOPUS_BITRATE_DEFAULT,
+  MODOPUS_VBR,
+  MODOPUS_CVBR,
+  MODOPUS_HARD_CBR
+};
+// Sample type passed from libopenmpt to libopusenc
+enum{
+  MODOPUS_FLOAT,
+  MODOPUS_S16
+};
+// complexity value for picking it from target_rtf while encoding
+#define MODOPUS_COMPLEXITY_AUTO -2
+
+// clip_start value for starting a clip at the most active part of the song
+#define MODOPUS_START_LOUDEST -1
+
+// Most outputs one --ladder can have
+#define MODOPUS_MAX_RUNGS 8
+
+// Blocks handed to the encoder that a --live stream keeps timestamps for
+#define MODOPUS_LIVE_MARKS 64
+
+// One output of a bitrate ladder, the rendered audio is shared by all
+typedef struct{
+  char name[16];     // added to the output name, song-name.opus
+  int32_t bitrate;   // bits per second or OPUS_AUTO
+  int32_t framesize; // 0 to use --framesize
+}modopus_rung;
+
 // Settings for encoding etc.
 typedef struct{
   int32_t framesize;
-  int32_t samplerate;
+  int32_t samplerate;  // rate libopenmpt renders at and libopusenc is fed
+  int32_t input_rate;  // --samplerate, see calc_buffer
   size_t buffersize;
   int32_t repeat_count;
   int32_t interpolation;
   int32_t gain;
+  int32_t subsong;     // -1 for the module's default subsong
+  int32_t channel;     // the only channel rendered with --stems, -1 for all
+  int32_t complexity;  // 0-10, -1 for the libopus default
+  int32_t bitrate;     // bits per second or OPUS_AUTO
+  int bitrate_mode;
+  int sample_format;
+  double target_rtf;   // realtime factor to meet with MODOPUS_COMPLEXITY_AUTO
+  double silence_threshold; // dBFS, quieter frames count as silence
+  double silence_hold;      // seconds of trailing silence that end the song
+  double normalize;    // target loudness in LUFS, 0 to keep the level
+  int32_t header_gain; // Opus output gain in Q7.8 dB, set per file by normalize
+  int64_t serialno;    // Ogg stream serial number, -1 for a random one
+  double lookahead;    // seconds --realtime may run ahead of the wall clock
+  double clip_start;   // seconds into the song, or MODOPUS_START_LOUDEST
+  double clip_length;  // seconds of audio converted, 0 to the end of the song
+  double fade_out;     // seconds faded out at the end of a clip
+  double segment_length;  // seconds per segment rendered in parallel, 0 for one piece
+  double segment_preroll; // seconds rendered and dropped before a segment
   int channels;
+  int jobs;
+  size_t ring_blocks;
+  modopus_rung ladder[MODOPUS_MAX_RUNGS];
+  int ladder_count;    // 0 for a single output using bitrate and framesize
   char *filename; 
+  FILE *output_stream; // set when every output goes to stdout or a fifo
   char *artist;
   char *title;
   char *date;
+  char *cache_path;
+  char *album;         // single chained output for every input, or NULL
+  char *pcm_cache;     // directory of rendered audio, NULL to always render
+  char *stats_path;
   bool auto_comment;
   bool print_sub;
   bool print_meta;
   bool dry_run;
   bool quiet;
+  bool pipeline;
+  bool all_subsongs;
+  bool verify_segments; // compare --segments with a serial render
+  bool stems;          // one output per channel
+  bool native_rate;    // render at input_rate instead of 48 kHz
+  bool reuse_encoder;  // continue one encoder from file to file
+  bool trim_silence;
+  bool stats;
+  bool live;           // low latency streaming, a page per block
+  bool realtime;       // pace conversion to playback speed
 }modopus_settings;
 
+/* Timing of a --live stream. The encoder side marks when each block is
+ * handed to libopusenc, the sink when the page ending in it is written.
+ */
+typedef struct{
+  double start;        // wall clock time the stream was started at
+  double first_audio;  // seconds to the first audio page, -1 until then
+  bool waiting;        // pages before the next OpusHead belong to the previous link
+  uint32_t serial;
+  uint32_t preskip;
+  uint64_t fed;        // 48 kHz samples handed to the encoder
+  uint64_t mark_samples[MODOPUS_LIVE_MARKS]; // fed after each block
+  double mark_time[MODOPUS_LIVE_MARKS];
+  size_t mark_head;
+  size_t mark_count;
+  double latency_sum;
+  double latency_max;
+  size_t pages;
+}live_clock;
+
+// Destination of an encoder created with create_opus_stream_encoder
+typedef struct{
+  FILE *file;
+  uint64_t bytes;
+  live_clock *clock;   // set with --live, every page is flushed and timed
+}modopus_sink;
+
+// Counters filled in by convert_stream
+typedef struct{
+  size_t frames;
+  size_t render_stalls; // render thread waited for a free ring block
+  size_t encode_stalls; // encoder waited for a rendered block
+  double load_time;     // seconds in create_mod
+  double render_time;   // seconds in libopenmpt
+  double encode_time;   // seconds in libopusenc, including the final drain
+  double wall_time;     // seconds from start to finish, the stages above overlap with --pipeline
+  uint64_t input_bytes;
+  uint64_t output_bytes;
+  bool output_approx;   // output_bytes leaves out pages a kept encoder still holds
+  int complexity;       // complexity chosen with MODOPUS_COMPLEXITY_AUTO
+  size_t lead_trimmed;  // frames of leading silence dropped
+  size_t tail_trimmed;  // frames of trailing silence dropped
+  double first_audio;   // --live: seconds to the first audio page
+  double latency_avg;   // --live: seconds from a block to its page, on average
+  double latency_max;
+}modopus_stats;
+
+// Audio for convert_stream, rendered by libopenmpt or read from the pcm cache
+typedef struct{
+  openmpt_module *mod;       // rendered when pcm is NULL
+  const float *pcm;          // cached audio, interleaved
+  size_t pcm_frames;
+  size_t pcm_pos;
+  struct pcm_record *record; // receives the rendered blocks, or NULL
+  struct segment_renderer *segments; // renders ahead on other threads, or NULL
+  size_t clip_left;          // frames left in a --duration clip, SIZE_MAX for all
+  size_t fade_frames;        // frames faded out before clip_left runs out
+  bool ended;                // the whole song has been read
+}modopus_source;
+
 typedef union{
   struct{
     char *artist;
@@ -39,17 +171,33 @@ void init_settings(modopus_settings *);
 void calc_buffer(modopus_settings *);
 void init_comments(modopus_comments *);
 void clean_comments(modopus_comments *);
-void print_settings(const char *, const char *, const modopus_settings);
+void print_settings(FILE *, const char *, const char *, const modopus_settings);
 
 bool validate_file(char **);
+bool has_module_extension(const char *);
 void supported(void);
 openmpt_module *create_mod(const char *, const modopus_settings);
-void module_print_metadata(openmpt_module *);
-void module_print_subsongs(openmpt_module *);
+openmpt_module *create_mod_from_memory(const void *, size_t, const char *, const modopus_settings);
+openmpt_module_ext *create_stem_from_memory(const void *, size_t, const char *, int32_t, const modopus_settings);
+openmpt_module *probe_mod(const char *);
+openmpt_module *probe_mod_memory(const void *, size_t);
+double module_probe_duration(const char *);
+void module_print_metadata(FILE *, openmpt_module *);
+void module_print_subsongs(FILE *, openmpt_module *);
 void module_get_comments(openmpt_module *, modopus_comments *);
 
 OggOpusComments *create_opus_comments(const modopus_comments);
+bool apply_preset(modopus_settings *, const char *);
 OggOpusEnc *create_opus_encoder(const char *, const modopus_settings, OggOpusComments *comm);
+OggOpusEnc *create_opus_stream_encoder(modopus_sink *, const modopus_settings, OggOpusComments *comm);
+bool continue_opus_encoder(OggOpusEnc *, const char *, const modopus_settings, OggOpusComments *comm);
 
-int convert_stream(openmpt_module *, OggOpusEnc *, const modopus_settings);
+modopus_settings rung_settings(const modopus_settings, int);
+size_t sample_bytes(const modopus_settings);
+size_t render_block(openmpt_module *, const modopus_settings, void *);
+void init_source(modopus_source *, openmpt_module *);
+size_t source_read(modopus_source *, const modopus_settings, void *);
+void live_clock_start(live_clock *);
+int convert_stream(modopus_source *, OggOpusEnc *, live_clock *, const modopus_settings, modopus_stats *);
+int convert_stream_ladder(modopus_source *, OggOpusEnc **, const modopus_settings, modopus_stats *);
 #endif
@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <opusenc.h>
+
+#include "modopus.h"
+#include "options.h"
+
+// Settings that need a value, every other setting is a flag
+static const char *valued_options[] = {
+  "samplerate",
+  "framesize",
+  "artist",
+  "title",
+  "date",
+  "repeat-count",
+  "gain",
+  "interpolation",
+  "ring-blocks",
+  "channels",
+  "silence-threshold",
+  "silence-hold",
+  "complexity",
+  "bitrate",
+  "preset",
+  "target-rtf",
+  "ladder",
+  "subsong",
+  "normalize",
+  "serialno",
+  "lookahead",
+  "sample-format",
+  "segments",
+  "start",
+  "duration",
+  "fade-out",
+  "preroll",
+  NULL
+};
+
+// A flag is set unless its value is "0" or "false"
+static bool flag_value(const char *value){
+  return value == NULL || (strcmp(value, "0") != 0 && strcmp(value, "false") != 0);
+}
+
+// Frame size in ms to the libopus constant
+static bool parse_framesize(const char *value, int32_t *framesize){
+  if(strcmp(value,"2.5") == 0) 
+    *framesize = OPUS_FRAMESIZE_2_5_MS;
+  else if(strcmp(value,"5") == 0) 
+    *framesize = OPUS_FRAMESIZE_5_MS;
+  else if(strcmp(value,"10") == 0) 
+    *framesize = OPUS_FRAMESIZE_10_MS;
+  else if(strcmp(value,"20") == 0)
+    *framesize = OPUS_FRAMESIZE_20_MS;
+  else if(strcmp(value,"40") == 0)
+    *framesize = OPUS_FRAMESIZE_40_MS;
+  else if(strcmp(value,"60") == 0)
+    *framesize = OPUS_FRAMESIZE_60_MS;
+  else
+    return false;
+  return true;
+}
+
+/* Parses a --ladder list of name:kbit/s[:framesize] outputs,
+ * such as hi:192,mid:96,lo:48:40
+ * return false if the list is malformed
+ */
+static bool parse_ladder(modopus_settings *opt, const char *value, FILE *msg){
+  char *copy = strdup(value);
+  if(copy == NULL){
+    return false;
+  }
+  int count = 0;
+  bool ok = true;
+  char *saveptr = NULL;
+  for(char *item = strtok_r(copy, ",", &saveptr); item != NULL && ok; item = strtok_r(NULL, ",", &saveptr)){
+    if(count == MODOPUS_MAX_RUNGS){
+      fprintf(msg, "--ladder takes at most %d outputs\n", MODOPUS_MAX_RUNGS);
+      ok = false;
+      break;
+    }
+    modopus_rung *rung = &opt->ladder[count];
+    char *name = item;
+    char *rate = strchr(item, ':');
+    if(rate == NULL){
+      ok = false;
+      break;
+    }
+    *rate ++ = '\0';
+    char *frame = strchr(rate, ':');
+    if(frame != NULL){
+      *frame ++ = '\0';
+    }
+    size_t len = strlen(name);
+    ok = len > 0 && len < sizeof(rung->name) && strspn(name,
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") == len;
+    double br = atof(rate);
+    ok = ok && br >= 6 && br <= 512;
+    rung->framesize = 0;
+    ok = ok && (frame == NULL || parse_framesize(frame, &rung->framesize));
+    strcpy(rung->name, ok ? name : "");
+    rung->bitrate = (int32_t)(br * 1000);
+    count ++;
+  }
+  free(copy);
+  if(!ok || count == 0){
+    fprintf(msg, "--ladder must be a list of name:kbit/s[:framesize], such as hi:192,lo:48:40\n");
+    return false;
+  }
+  opt->ladder_count = count;
+  return true;
+}
+
+/* Applies a single conversion setting, as given on the command line or
+ * in a --serve request.
+ * param opt settings to change
+ * param name long option name without the leading --
+ * param value option argument, NULL for flags
+ * param msg receives the reason a value is rejected
+ * return 0 on success, 1 if value is invalid, -1 if name isn't a setting
+ */
+int set_option(modopus_settings *opt, const char *name, char *value, FILE *msg){
+  for(size_t i = 0; valued_options[i] != NULL; i ++){
+    if(value == NULL && strcmp(name, valued_options[i]) == 0){
+      fprintf(msg, "--%s needs a value\n", name);
+      return 1;
+    }
+  }
+  if(strcmp(name,"samplerate") == 0){ /* set sample rate */
+    int32_t rate = atoi(value);
+    // The range libopenmpt renders at, see --native-rate
+    if(rate < 8000 || rate > 192000){
+      fprintf(msg, "--samplerate must be between 8000 and 192000\n");
+      return 1;
+    }
+    opt->input_rate = rate;
+  }
+  else if(strcmp(name,"framesize") == 0){ /* set frame size */
+    if(!parse_framesize(value, &opt->framesize)){
+      fprintf(msg, "--framesize must be one of the following: [2.5, 5, 10, 20, 40, 60].\n");
+      return 1;
+    }
+  }
+  else if(strcmp(name, "auto-comment") == 0){ // add comments from input file
+    opt->auto_comment = flag_value(value);
+  }
+  else if(strcmp(name, "artist") == 0){ // set artist tag
+    opt->artist = value;
+  }
+  else if(strcmp(name, "title") == 0){ // set title tag
+    opt->title = value;
+  }
+  else if(strcmp(name, "date") == 0){ // set date tag
+    opt->date = value;
+  }
+  else if(strcmp(name, "repeat-count") == 0){ // plays n + 1 times
+    int32_t rc = atoi(value);
+    if(rc < 0){
+      fprintf(msg, "--repeat-count must be 0 (no loops) or n > 0 (play once and loop n times)\n");
+      return 1;
+    }
+    opt->repeat_count = rc;
+  }
+  else if(strcmp(name, "gain") == 0){ // set gain in mB
+    opt->gain = atoi(value);
+  }
+  else if(strcmp(name, "interpolation") == 0){ // set interpolation filter preset
+    int32_t ifl = atoi(value);
+    if(ifl < 0){
+      fprintf(msg, "Interpolation value must be grater than 0, see --help for more\n");
+      return 1;
+    }
+    opt->interpolation = ifl;
+  }
+  else if(strcmp(name, "subsong") == 0){ // convert a subsong other than the default
+    int32_t sub = atoi(value);
+    if(sub < 0){
+      fprintf(msg, "--subsong must be 0 or greater, see --print-subsongs\n");
+      return 1;
+    }
+    opt->subsong = sub;
+  }
+  else if(strcmp(name, "all-subsongs") == 0){ // one output per subsong
+    opt->all_subsongs = flag_value(value);
+  }
+  else if(strcmp(name, "stems") == 0){ // one output per channel
+    opt->stems = flag_value(value);
+  }
+  else if(strcmp(name, "print-subsongs") == 0){ // print list of subsongs and numbers
+    opt->print_sub = flag_value(value);
+  }
+  else if(strcmp(name, "print-metadata") == 0){ // print song metadata
+    opt->print_meta = flag_value(value);
+  }
+  else if(strcmp(name, "dry-run") == 0){ // skips encoding to file
+    opt->dry_run = flag_value(value);
+  }
+  else if(strcmp(name, "native-rate") == 0){ // render at --samplerate
+    opt->native_rate = flag_value(value);
+  }
+  else if(strcmp(name, "pipeline") == 0){ // render on a separate thread
+    opt->pipeline = flag_value(value);
+  }
+  else if(strcmp(name, "sample-format") == 0){ // pcm type between libopenmpt and libopusenc
+    if(strcmp(value, "float") == 0)
+      opt->sample_format = MODOPUS_FLOAT;
+    else if(strcmp(value, "s16") == 0)
+      opt->sample_format = MODOPUS_S16;
+    else{
+      fprintf(msg, "--sample-format must be one of the following: [float, s16].\n");
+      return 1;
+    }
+  }
+  else if(strcmp(name, "live") == 0){ // low latency streaming
+    opt->live = flag_value(value);
+  }
+  else if(strcmp(name, "realtime") == 0){ // no faster than playback
+    opt->realtime = flag_value(value);
+  }
+  else if(strcmp(name, "lookahead") == 0){ // ms --realtime may run ahead
+    double ms = atof(value);
+    if(ms < 0){
+      fprintf(msg, "--lookahead must be 0 or greater\n");
+      return 1;
+    }
+    opt->lookahead = ms / 1000;
+  }
+  else if(strcmp(name, "start") == 0){ // seconds into the song a clip starts
+    if(strcmp(value, "auto") == 0){
+      opt->clip_start = MODOPUS_START_LOUDEST;
+    }
+    else{
+      double start = atof(value);
+      if(start < 0){
+        fprintf(msg, "--start must be 0 or greater, or auto\n");
+        return 1;
+      }
+      opt->clip_start = start;
+    }
+  }
+  else if(strcmp(name, "duration") == 0){ // seconds of the song converted
+    double length = atof(value);
+    if(length < 0){
+      fprintf(msg, "--duration must be 0 or greater\n");
+      return 1;
+    }
+    opt->clip_length = length;
+  }
+  else if(strcmp(name, "fade-out") == 0){ // seconds faded out at the end of a clip
+    double fade = atof(value);
+    if(fade < 0){
+      fprintf(msg, "--fade-out must be 0 or greater\n");
+      return 1;
+    }
+    opt->fade_out = fade;
+  }
+  else if(strcmp(name, "preview") == 0){ // short clip for catalogs
+    if(flag_value(value)){
+      apply_preset(opt, "preview");
+    }
+  }
+  else if(strcmp(name, "segments") == 0){ // seconds per segment rendered in parallel
+    double length = atof(value);
+    if(length < 0){
+      fprintf(msg, "--segments must be 0 or greater\n");
+      return 1;
+    }
+    opt->segment_length = length;
+  }
+  else if(strcmp(name, "preroll") == 0){ // seconds rendered before a segment
+    double preroll = atof(value);
+    if(preroll < 0){
+      fprintf(msg, "--preroll must be 0 or greater\n");
+      return 1;
+    }
+    opt->segment_preroll = preroll;
+  }
+  else if(strcmp(name, "verify-segments") == 0){ // compare with a serial render
+    opt->verify_segments = flag_value(value);
+  }
+  else if(strcmp(name, "ring-blocks") == 0){ // blocks buffered between threads
+    int rb = atoi(value);
+    if(rb < 2){
+      fprintf(msg, "--ring-blocks must be 2 or greater\n");
+      return 1;
+    }
+    opt->ring_blocks = rb;
+  }
+  else if(strcmp(name, "channels") == 0){ // mono, stereo or quad output
+    int ch = atoi(value);
+    if(ch != 1 && ch != 2 && ch != 4){
+      fprintf(msg, "--channels must be one of the following: [1, 2, 4].\n");
+      return 1;
+    }
+    opt->channels = ch;
+  }
+  else if(strcmp(name, "normalize") == 0){ // loudness target in LUFS
+    double lufs = atof(value);
+    if(lufs >= 0 || lufs < -70){
+      fprintf(msg, "--normalize must be between -70 and 0 LUFS, such as -23 or -16\n");
+      return 1;
+    }
+    opt->normalize = lufs;
+  }
+  else if(strcmp(name, "serialno") == 0){ // fixed Ogg serial number for reproducible output
+    char *end;
+    long long serial = strtoll(value, &end, 10);
+    if(*value == '\0' || *end != '\0' || serial < 0 || serial > UINT32_MAX){
+      fprintf(msg, "--serialno must be between 0 and %u\n", UINT32_MAX);
+      return 1;
+    }
+    opt->serialno = serial;
+  }
+  else if(strcmp(name, "trim-silence") == 0){ // drop leading and trailing silence
+    opt->trim_silence = flag_value(value);
+  }
+  else if(strcmp(name, "silence-threshold") == 0){ // level in dBFS counted as silence
+    double db = atof(value);
+    if(db >= 0){
+      fprintf(msg, "--silence-threshold must be below 0 dBFS\n");
+      return 1;
+    }
+    opt->silence_threshold = db;
+  }
+  else if(strcmp(name, "silence-hold") == 0){ // seconds of silence that end the song
+    double hold = atof(value);
+    if(hold <= 0){
+      fprintf(msg, "--silence-hold must be greater than 0\n");
+      return 1;
+    }
+    opt->silence_hold = hold;
+  }
+  else if(strcmp(name, "complexity") == 0){ // encoder cpu/quality trade off
+    if(strcmp(value, "auto") == 0){
+      opt->complexity = MODOPUS_COMPLEXITY_AUTO;
+    }
+    else{
+      int32_t cx = atoi(value);
+      if(cx < 0 || cx > 10){
+        fprintf(msg, "--complexity must be 0 to 10 or auto\n");
+        return 1;
+      }
+      opt->complexity = cx;
+    }
+  }
+  else if(strcmp(name, "bitrate") == 0){ // target bitrate in kbit/s
+    double br = atof(value);
+    if(br < 6 || br > 512){
+      fprintf(msg, "--bitrate must be between 6 and 512 kbit/s\n");
+      return 1;
+    }
+    opt->bitrate = (int32_t)(br * 1000);
+  }
+  else if(strcmp(name, "vbr") == 0){ // unconstrained variable bitrate
+    opt->bitrate_mode = flag_value(value) ? MODOPUS_VBR : MODOPUS_BITRATE_DEFAULT;
+  }
+  else if(strcmp(name, "cvbr") == 0){ // constrained variable bitrate
+    opt->bitrate_mode = flag_value(value) ? MODOPUS_CVBR : MODOPUS_BITRATE_DEFAULT;
+  }
+  else if(strcmp(name, "hard-cbr") == 0){ // constant bitrate
+    opt->bitrate_mode = flag_value(value) ? MODOPUS_HARD_CBR : MODOPUS_BITRATE_DEFAULT;
+  }
+  else if(strcmp(name, "preset") == 0){ // named encoder profile
+    if(!apply_preset(opt, value)){
+      fprintf(msg, "--preset must be one of the following: [fast, balanced, archive, preview].\n");
+      return 1;
+    }
+  }
+  else if(strcmp(name, "ladder") == 0){ // several bitrates from one render
+    if(!parse_ladder(opt, value, msg)){
+      return 1;
+    }
+  }
+  else if(strcmp(name, "target-rtf") == 0){ // realtime factor for --complexity auto
+    double rtf = atof(value);
+    if(rtf <= 0){
+      fprintf(msg, "--target-rtf must be greater than 0\n");
+      return 1;
+    }
+    opt->target_rtf = rtf;
+  }
+  else{
+    return -1;
+  }
+  return 0;
+}
+
+/* Checks for settings that can't be used together, after every option
+ * has been applied and the output has been opened.
+ * param msg receives the reason the settings are rejected
+ * return false if the settings can't be used
+ */
+bool validate_settings(const modopus_settings *opt, FILE *msg){
+  if(opt->live && opt->output_stream == NULL){
+    fprintf(msg, "--live needs -o - or a fifo\n");
+    return false;
+  }
+  if(opt->output_stream != NULL && opt->ladder_count > 0){
+    fprintf(msg, "--ladder needs an output directory, not a stream\n");
+    return false;
+  }
+  if(opt->ladder_count > 0 && (opt->album != NULL || opt->reuse_encoder)){
+    fprintf(msg, "--ladder can't be used with --album or --reuse-encoder\n");
+    return false;
+  }
+  if((opt->ladder_count > 0 || opt->all_subsongs || opt->stems) && opt->cache_path != NULL){
+    fprintf(msg, "--ladder, --all-subsongs and --stems can't be used with --cache\n");
+    return false;
+  }
+  if(opt->segment_length > 0 && opt->repeat_count != 0){
+    // Seeking by time always lands in the first pass of the song
+    fprintf(msg, "--segments can't be used with --repeat-count. A repeat plays on from the\n"
+        "song's loop point in the state the previous pass left, which a segment can't\n"
+        "seek to. Drop --segments, or render one pass in segments with --repeat-count 0.\n");
+    return false;
+  }
+  if(opt->segment_length > 0 && (opt->stems || opt->all_subsongs)){
+    fprintf(msg, "--segments can't be used with --stems or --all-subsongs\n");
+    return false;
+  }
+  if(opt->segment_length > 0 && (opt->clip_start != 0 || opt->clip_length > 0)){
+    fprintf(msg, "--segments can't be used with --start or --duration\n");
+    return false;
+  }
+  if(opt->clip_start == MODOPUS_START_LOUDEST && opt->clip_length <= 0){
+    fprintf(msg, "--start auto needs --duration\n");
+    return false;
+  }
+  if(opt->stems && (opt->all_subsongs || opt->album != NULL || opt->output_stream != NULL)){
+    fprintf(msg, "--stems needs an output directory and can't be used with --all-subsongs or --album\n");
+    return false;
+  }
+  return true;
+}
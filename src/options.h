@@ -0,0 +1,10 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "modopus.h"
+
+int set_option(modopus_settings *, const char *, char *, FILE *);
+bool validate_settings(const modopus_settings *, FILE *);
+#endif
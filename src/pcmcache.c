@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "modopus.h"
+#include "mapfile.h"
+#include "cache.h"
+#include "split_path.h"
+#include "pcmcache.h"
+
+/* An entry is this header followed by the rendered audio as native
+ * endian floats, in the interleaved layout libopenmpt renders.
+ */
+#define PCM_MAGIC "MODOPCM1"
+
+typedef struct{
+  char magic[8];
+  uint32_t channels;
+  uint32_t samplerate;
+  uint64_t frames;
+}pcm_header;
+
+// Hash of the settings that change what libopenmpt renders, and the subsong
+uint64_t render_key(const modopus_settings opt){
+  int32_t fields[] = {
+    opt.samplerate,
+    opt.interpolation,
+    opt.gain,
+    opt.subsong,
+    opt.repeat_count,
+    opt.channels
+  };
+  return hash_bytes(0, fields, sizeof(fields));
+}
+
+/* Path of the cache entry for a module.
+ * param dir cache directory
+ * param hash hash of the module file contents
+ * return path in a new string, NULL on failure
+ */
+char *pcm_cache_path(const char *dir, uint64_t hash, const modopus_settings opt){
+  char name[64];
+  snprintf(name, sizeof(name), "%016" PRIx64 "-%016" PRIx64 ".pcm", hash, render_key(opt));
+  return join_path(dir, name);
+}
+
+/* Maps a cache entry, checking that it fits opt.
+ * return false if there is no usable entry
+ */
+bool pcm_cache_open(const char *path, const modopus_settings opt, pcm_entry *entry){
+  if(access(path, R_OK) != 0 || !map_file(path, &entry->file)){
+    return false;
+  }
+  const pcm_header *header = entry->file.data;
+  if(entry->file.size < sizeof(pcm_header)
+      || memcmp(header->magic, PCM_MAGIC, sizeof(header->magic)) != 0
+      || header->channels != (uint32_t)opt.channels
+      || header->samplerate != (uint32_t)opt.samplerate
+      || header->frames != (entry->file.size - sizeof(pcm_header)) / (opt.channels * sizeof(float))){
+    fprintf(stderr, "%s: damaged pcm cache entry, rendering again\n", path);
+    unmap_file(&entry->file);
+    return false;
+  }
+  entry->pcm = (const float *)(header + 1);
+  entry->frames = header->frames;
+  return true;
+}
+
+void pcm_cache_close(pcm_entry *entry){
+  unmap_file(&entry->file);
+  entry->pcm = NULL;
+  entry->frames = 0;
+}
+
+/* Starts writing a cache entry to a temporary file next to path.
+ * Other converters never see the entry before pcm_record_finish.
+ * return false if the file could not be created
+ */
+bool pcm_record_start(pcm_record *record, const char *path, const modopus_settings opt){
+  record->frames = 0;
+  record->failed = false;
+  record->path = strdup(path);
+  record->tmppath = malloc(strlen(path) + sizeof(".XXXXXX"));
+  if(record->path == NULL || record->tmppath == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    free(record->path);
+    free(record->tmppath);
+    return false;
+  }
+  strcpy(record->tmppath, path);
+  strcat(record->tmppath, ".XXXXXX");
+  int fd = mkstemp(record->tmppath);
+  if(fd != -1){
+    // mkstemp creates the file private, umask() would race other jobs
+    fchmod(fd, 0644);
+  }
+  record->file = fd == -1 ? NULL : fdopen(fd, "wb");
+  if(record->file == NULL){
+    if(fd != -1){
+      close(fd);
+      unlink(record->tmppath);
+    }
+    fprintf(stderr, "%s: failed creating pcm cache entry\n", path);
+    free(record->path);
+    free(record->tmppath);
+    return false;
+  }
+  pcm_header header = {PCM_MAGIC, opt.channels, opt.samplerate, 0};
+  record->failed = fwrite(&header, sizeof(header), 1, record->file) != 1;
+  return true;
+}
+
+// Appends a rendered block of frames
+void pcm_record_write(pcm_record *record, const float *block, size_t frames, int channels){
+  if(record->failed){
+    return;
+  }
+  if(fwrite(block, sizeof(float) * channels, frames, record->file) != frames){
+    record->failed = true;
+  }
+  record->frames += frames;
+}
+
+/* Publishes the entry, or drops it.
+ * param complete true if the whole song was recorded
+ */
+void pcm_record_finish(pcm_record *record, bool complete){
+  bool keep = complete && !record->failed;
+  if(keep){
+    // The length is only known now that rendering is done
+    keep = fseek(record->file, offsetof(pcm_header, frames), SEEK_SET) == 0
+      && fwrite(&record->frames, sizeof(record->frames), 1, record->file) == 1;
+  }
+  keep = fclose(record->file) == 0 && keep;
+  if(!keep || rename(record->tmppath, record->path) != 0){
+    unlink(record->tmppath);
+  }
+  free(record->path);
+  free(record->tmppath);
+  record->file = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef PCMCACHE_H
+#define PCMCACHE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "modopus.h"
+#include "mapfile.h"
+
+// A rendered module in the pcm cache, memory mapped
+typedef struct{
+  modopus_file file;
+  const float *pcm;  // interleaved, opt.channels per frame
+  size_t frames;
+}pcm_entry;
+
+// A cache entry being written while the module renders
+typedef struct pcm_record{
+  FILE *file;
+  char *tmppath;
+  char *path;
+  uint64_t frames;
+  bool failed;
+}pcm_record;
+
+uint64_t render_key(const modopus_settings);
+char *pcm_cache_path(const char *, uint64_t, const modopus_settings);
+bool pcm_cache_open(const char *, const modopus_settings, pcm_entry *);
+void pcm_cache_close(pcm_entry *);
+bool pcm_record_start(pcm_record *, const char *, const modopus_settings);
+void pcm_record_write(pcm_record *, const float *, size_t, int);
+void pcm_record_finish(pcm_record *, bool);
+#endif
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sched.h>
+
+#include "ring.h"
+
+// Yields before a waiting side goes to sleep, enough to cover a short hiccup
+#define RING_SPINS 64
+
+/* Sets up a ring of slots blocks of slot_len bytes each.
+ * return false if memory could not be allocated
+ */
+bool ring_init(modopus_ring *ring, size_t slots, size_t slot_len){
+  ring->data = calloc(slots, slot_len);
+  ring->counts = calloc(slots, sizeof(size_t));
+  if(ring->data == NULL || ring->counts == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    free(ring->data);
+    free(ring->counts);
+    return false;
+  }
+  ring->slots = slots;
+  ring->slot_len = slot_len;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->closed, false);
+  atomic_init(&ring->aborted, false);
+  atomic_init(&ring->sleepers, 0);
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->wake, NULL);
+  ring->producer_stalls = 0;
+  ring->consumer_stalls = 0;
+  return true;
+}
+
+void ring_free(modopus_ring *ring){
+  free(ring->data);
+  free(ring->counts);
+  ring->data = NULL;
+  ring->counts = NULL;
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->wake);
+}
+
+/* Wakes the other side if it went to sleep. Called after every change
+ * it may be waiting for. The change and sleepers are both sequentially
+ * consistent, so either the sleeper sees the change before waiting or
+ * this sees the sleeper and signals it under the lock.
+ */
+static void ring_wake(modopus_ring *ring){
+  if(atomic_load(&ring->sleepers) > 0){
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+/* One round of waiting for the other side. The first RING_SPINS rounds
+ * only yield, after that the thread sleeps until ready returns true.
+ */
+static void ring_wait(modopus_ring *ring, size_t spins, bool (*ready)(modopus_ring *)){
+  if(spins < RING_SPINS){
+    sched_yield();
+    return;
+  }
+  pthread_mutex_lock(&ring->lock);
+  atomic_fetch_add(&ring->sleepers, 1);
+  while(!ready(ring)){
+    pthread_cond_wait(&ring->wake, &ring->lock);
+  }
+  atomic_fetch_sub(&ring->sleepers, 1);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+// A slot is free or the consumer gave up
+static bool can_write(modopus_ring *ring){
+  return atomic_load(&ring->head) - atomic_load(&ring->tail) < ring->slots
+    || atomic_load(&ring->aborted);
+}
+
+// A block is ready or the stream ended
+static bool can_read(modopus_ring *ring){
+  return atomic_load(&ring->head) != atomic_load(&ring->tail)
+    || atomic_load(&ring->closed);
+}
+
+/* Waits for a free slot.
+ * return the slot to render into, or NULL if the consumer gave up
+ */
+void *ring_acquire_write(modopus_ring *ring){
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t spins = 0;
+  while(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == ring->slots){
+    if(atomic_load_explicit(&ring->aborted, memory_order_relaxed)){
+      return NULL;
+    }
+    if(spins == 0){
+      ring->producer_stalls ++;
+    }
+    ring_wait(ring, spins ++, can_write);
+  }
+  if(atomic_load_explicit(&ring->aborted, memory_order_relaxed)){
+    return NULL;
+  }
+  return &ring->data[(head % ring->slots) * ring->slot_len];
+}
+
+// Publishes the slot from ring_acquire_write holding count frames
+void ring_commit_write(modopus_ring *ring, size_t count){
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  ring->counts[head % ring->slots] = count;
+  atomic_store(&ring->head, head + 1);
+  ring_wake(ring);
+}
+
+// Marks the end of the stream, no more blocks will be written
+void ring_close(modopus_ring *ring){
+  atomic_store(&ring->closed, true);
+  ring_wake(ring);
+}
+
+/* Waits for a rendered block.
+ * param count set to the number of frames in the block
+ * return the block, or NULL once the ring is closed and drained
+ */
+const void *ring_acquire_read(modopus_ring *ring, size_t *count){
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t spins = 0;
+  while(atomic_load_explicit(&ring->head, memory_order_acquire) == tail){
+    if(atomic_load_explicit(&ring->closed, memory_order_acquire)){
+      // The producer may have committed a last block before closing
+      if(atomic_load_explicit(&ring->head, memory_order_acquire) != tail){
+        break;
+      }
+      return NULL;
+    }
+    if(spins == 0){
+      ring->consumer_stalls ++;
+    }
+    ring_wait(ring, spins ++, can_read);
+  }
+  *count = ring->counts[tail % ring->slots];
+  return &ring->data[(tail % ring->slots) * ring->slot_len];
+}
+
+// Hands the block from ring_acquire_read back to the producer
+void ring_commit_read(modopus_ring *ring){
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store(&ring->tail, tail + 1);
+  ring_wake(ring);
+}
+
+// Tells the producer to stop, used when the consumer fails
+void ring_abort(modopus_ring *ring){
+  atomic_store(&ring->aborted, true);
+  ring_wake(ring);
+}
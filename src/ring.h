@@ -0,0 +1,40 @@
+#ifndef RING_H
+#define RING_H
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Single producer, single consumer ring of fixed size pcm blocks.
+ * head and tail only ever increase, a slot is head % slots.
+ * Blocks are raw memory, float or int16 samples depending on --sample-format.
+ * A side that has to wait spins briefly, then sleeps until the other
+ * side signals, so a stalled thread doesn't keep a core busy.
+ */
+typedef struct{
+  unsigned char *data;
+  size_t *counts;
+  size_t slots;
+  size_t slot_len;   // bytes
+  atomic_size_t head;
+  atomic_size_t tail;
+  atomic_bool closed;
+  atomic_bool aborted;
+  atomic_int sleepers; // threads waiting on wake
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  size_t producer_stalls;
+  size_t consumer_stalls;
+}modopus_ring;
+
+bool ring_init(modopus_ring *, size_t, size_t);
+void ring_free(modopus_ring *);
+
+void *ring_acquire_write(modopus_ring *);
+void ring_commit_write(modopus_ring *, size_t);
+void ring_close(modopus_ring *);
+
+const void *ring_acquire_read(modopus_ring *, size_t *);
+void ring_commit_read(modopus_ring *);
+void ring_abort(modopus_ring *);
+#endif
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <libopenmpt/libopenmpt.h>
+
+#include "modopus.h"
+#include "split_path.h"
+#include "stats.h"
+#include "scan.h"
+
+// Growable list of module paths found while walking directories
+typedef struct{
+  char **paths;
+  size_t count;
+  size_t cap;
+}path_list;
+
+// State shared between the scan threads
+typedef struct{
+  char **paths;
+  size_t count;
+  atomic_size_t next;
+  atomic_size_t failed;
+  pthread_mutex_t print_lock;
+  int format;
+}scan_state;
+
+static bool list_add(path_list *list, char *path){
+  if(list->count == list->cap){
+    size_t cap = list->cap == 0 ? 256 : list->cap * 2;
+    char **tmp = realloc(list->paths, cap * sizeof(char *));
+    if(tmp == NULL){
+      fprintf(stderr, "Failed allocating memory\n");
+      free(path);
+      return false;
+    }
+    list->paths = tmp;
+    list->cap = cap;
+  }
+  list->paths[list->count ++] = path;
+  return true;
+}
+
+/* Adds every supported module below dir to list.
+ * Symbolic links to directories aren't followed.
+ * return number of directories that could not be read
+ */
+static size_t collect_dir(const char *dir, path_list *list){
+  DIR *d = opendir(dir);
+  if(d == NULL){
+    fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  size_t failed = 0;
+  struct dirent *entry;
+  while((entry = readdir(d)) != NULL){
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0){
+      continue;
+    }
+    char *path = join_path(dir, entry->d_name);
+    if(path == NULL){
+      continue;
+    }
+    struct stat st;
+    if(lstat(path, &st) != 0){
+      free(path);
+      continue;
+    }
+    if(S_ISDIR(st.st_mode)){
+      failed += collect_dir(path, list);
+      free(path);
+    }
+    else if(S_ISREG(st.st_mode) && has_module_extension(entry->d_name)){
+      if(!list_add(list, path)){
+        failed ++;
+        break;
+      }
+    }
+    else{
+      free(path);
+    }
+  }
+  closedir(d);
+  return failed;
+}
+
+// Writes str as a quoted CSV field
+static void csv_string(FILE *out, const char *str){
+  fputc('"', out);
+  for(; *str != '\0'; str ++){
+    if(*str == '"'){
+      fputc('"', out);
+    }
+    fputc(*str, out);
+  }
+  fputc('"', out);
+}
+
+/* Prints a row per subsong, so every subsong gets its own name and
+ * duration like in the JSON output.
+ */
+static void scan_csv(FILE *out, const char *path, openmpt_module *mod){
+  const char *keys[] = {"type", "type_long", "tracker", "title", "artist", "date"};
+  const char *values[sizeof(keys) / sizeof(keys[0])];
+  for(size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i ++){
+    values[i] = openmpt_module_get_metadata(mod, keys[i]);
+  }
+  int32_t num_subsongs = openmpt_module_get_num_subsongs(mod);
+  for(int32_t i = 0; i < num_subsongs; i ++){
+    const char *name = openmpt_module_get_subsong_name(mod, i);
+    openmpt_module_select_subsong(mod, i);
+    csv_string(out, path);
+    for(size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k ++){
+      fputc(',', out);
+      csv_string(out, values[k]);
+    }
+    fprintf(out, ",%d,%d,", num_subsongs, i);
+    csv_string(out, name);
+    fprintf(out, ",%.3f\n", openmpt_module_get_duration_seconds(mod));
+    free((char *)name);
+  }
+  for(size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i ++){
+    free((char *)values[i]);
+  }
+}
+
+static void scan_json(FILE *out, const char *path, openmpt_module *mod){
+  fprintf(out, "{\"file\":");
+  json_string(out, path);
+  fprintf(out, ",\"duration_s\":%.3f,\"metadata\":{", openmpt_module_get_duration_seconds(mod));
+  const char *keys = openmpt_module_get_metadata_keys(mod);
+  char *copy = strdup(keys);
+  char *saveptr = NULL;
+  bool first = true;
+  for(char *key = strtok_r(copy, ";", &saveptr); key != NULL; key = strtok_r(NULL, ";", &saveptr)){
+    const char *value = openmpt_module_get_metadata(mod, key);
+    fprintf(out, "%s", first ? "" : ",");
+    json_string(out, key);
+    fputc(':', out);
+    json_string(out, value);
+    free((char *)value);
+    first = false;
+  }
+  free(copy);
+  free((char *)keys);
+  fprintf(out, "},\"subsongs\":[");
+  int32_t num_subsongs = openmpt_module_get_num_subsongs(mod);
+  for(int32_t i = 0; i < num_subsongs; i ++){
+    const char *name = openmpt_module_get_subsong_name(mod, i);
+    openmpt_module_select_subsong(mod, i);
+    fprintf(out, "%s{\"index\":%d,\"name\":", i == 0 ? "" : ",", i);
+    json_string(out, name);
+    fprintf(out, ",\"duration_s\":%.3f}", openmpt_module_get_duration_seconds(mod));
+    free((char *)name);
+  }
+  fprintf(out, "]}\n");
+}
+
+static void *scan_worker(void *arg){
+  scan_state *scan = arg;
+  size_t i;
+  while((i = atomic_fetch_add(&scan->next, 1)) < scan->count){
+    const char *path = scan->paths[i];
+    openmpt_module *mod = probe_mod(path);
+    if(mod == NULL){
+      fprintf(stderr, "%s: failed creating openmpt_module\n", path);
+      atomic_fetch_add(&scan->failed, 1);
+      continue;
+    }
+    // Each line is built first, so lines of different threads don't mix
+    char *line = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&line, &len);
+    if(out == NULL){
+      openmpt_module_destroy(mod);
+      atomic_fetch_add(&scan->failed, 1);
+      continue;
+    }
+    if(scan->format == SCAN_JSON){
+      scan_json(out, path, mod);
+    }
+    else{
+      scan_csv(out, path, mod);
+    }
+    fclose(out);
+    openmpt_module_destroy(mod);
+    pthread_mutex_lock(&scan->print_lock);
+    fwrite(line, 1, len, stdout);
+    pthread_mutex_unlock(&scan->print_lock);
+    free(line);
+  }
+  return NULL;
+}
+
+/* Prints metadata, subsongs and estimated duration of every module in
+ * paths, one line each, or one per subsong for csv. Directories are
+ * searched recursively.
+ * Modules are loaded without sample and plugin data.
+ * param paths files and directories to scan
+ * param count number of paths
+ * param format SCAN_CSV or SCAN_JSON
+ * param jobs number of modules loaded at the same time
+ * return number of modules and directories that could not be read
+ */
+int run_scan(char **paths, size_t count, int format, int jobs){
+  path_list list = {NULL, 0, 0};
+  size_t unlisted = 0;
+  for(size_t i = 0; i < count; i ++){
+    struct stat st;
+    if(stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)){
+      unlisted += collect_dir(paths[i], &list);
+    }
+    else{
+      char *path = strdup(paths[i]);
+      if(path == NULL || !list_add(&list, path)){
+        unlisted ++;
+        break;
+      }
+    }
+  }
+
+  scan_state scan;
+  scan.paths = list.paths;
+  scan.count = list.count;
+  scan.format = format;
+  atomic_init(&scan.next, 0);
+  atomic_init(&scan.failed, 0);
+  pthread_mutex_init(&scan.print_lock, NULL);
+  if(format == SCAN_CSV){
+    printf("file,type,type_long,tracker,title,artist,date,subsongs,subsong,subsong_name,duration_s\n");
+  }
+
+  size_t nthreads = jobs > 1 ? (size_t)jobs - 1 : 0;
+  pthread_t threads[nthreads > 0 ? nthreads : 1];
+  size_t started = 0;
+  for(; started < nthreads; started ++){
+    if(pthread_create(&threads[started], NULL, scan_worker, &scan) != 0){
+      break;
+    }
+  }
+  scan_worker(&scan);
+  for(size_t i = 0; i < started; i ++){
+    pthread_join(threads[i], NULL);
+  }
+  fflush(stdout);
+
+  pthread_mutex_destroy(&scan.print_lock);
+  for(size_t i = 0; i < list.count; i ++){
+    free(list.paths[i]);
+  }
+  free(list.paths);
+  return (int)(atomic_load(&scan.failed) + unlisted);
+}
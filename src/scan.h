@@ -0,0 +1,12 @@
+#ifndef SCAN_H
+#define SCAN_H
+#include <stddef.h>
+
+// Output formats of --scan
+enum{
+  SCAN_CSV,
+  SCAN_JSON
+};
+
+int run_scan(char **, size_t, int, int);
+#endif
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <libopenmpt/libopenmpt.h>
+
+#include "modopus.h"
+#include "mapfile.h"
+#include "segment.h"
+
+enum{
+  SEGMENT_QUEUED,
+  SEGMENT_DONE,
+  SEGMENT_FAILED
+};
+
+// Seeks that land after the segment start are retried this often, further back
+#define SEGMENT_SEEK_TRIES 4
+
+// Creates a module instance positioned at the start of opt.subsong
+static openmpt_module *segment_module(const segment_renderer *r){
+  openmpt_module *mod = create_mod_from_memory(r->file->data, r->file->size, r->path, r->opt);
+  if(mod != NULL && r->opt.subsong >= 0 && !openmpt_module_select_subsong(mod, r->opt.subsong)){
+    fprintf(stderr, "%s: failed selecting subsong %d\n", r->path, r->opt.subsong);
+    openmpt_module_destroy(mod);
+    return NULL;
+  }
+  return mod;
+}
+
+/* Renders and drops frames, for the pre-roll.
+ * return false if the song ended first
+ */
+static bool skip_frames(openmpt_module *mod, modopus_settings opt, size_t frames, void *scratch){
+  size_t block = opt.buffersize;
+  while(frames > 0){
+    opt.buffersize = frames < block ? frames : block;
+    size_t count = render_block(mod, opt, scratch);
+    if(count == 0){
+      return false;
+    }
+    frames -= count;
+  }
+  return true;
+}
+
+/* Renders segment i. Seeking goes to the start of a row, so the frames
+ * between where the seek landed and the segment start are rendered and
+ * dropped, at least opt.segment_preroll seconds of them.
+ * return false on errors
+ */
+static bool render_segment(segment_renderer *r, openmpt_module *mod, size_t i, void *scratch){
+  segment *seg = &r->segments[i];
+  const modopus_settings opt = r->opt;
+  uint64_t start = (uint64_t)i * r->length;
+  double want = (double)start / opt.samplerate - opt.segment_preroll;
+  uint64_t skip = 0;
+  for(int tries = 0; ; tries ++){
+    if(want < 0){
+      want = 0;
+    }
+    double at = openmpt_module_set_position_seconds(mod, want);
+    long long at_frame = llround(at * opt.samplerate);
+    if(at_frame >= 0 && (uint64_t)at_frame <= start){
+      skip = start - at_frame;
+      break;
+    }
+    if(tries == SEGMENT_SEEK_TRIES || want == 0){
+      fprintf(stderr, "%s: could not seek to %.3f s\n", r->path, (double)start / opt.samplerate);
+      return false;
+    }
+    want -= opt.segment_preroll;
+  }
+  if(!skip_frames(mod, opt, skip, scratch)){
+    seg->last = true;
+    return true;
+  }
+
+  bool last = i == r->count - 1;
+  for(;;){
+    if(!last && seg->frames == r->length){
+      break;
+    }
+    modopus_settings block = opt;
+    if(!last && r->length - seg->frames < opt.buffersize){
+      block.buffersize = r->length - seg->frames;
+    }
+    // Only the last segment grows past its length
+    if(seg->frames + block.buffersize > seg->cap){
+      size_t cap = seg->cap == 0 ? r->length : seg->cap * 2;
+      unsigned char *pcm = realloc(seg->pcm, cap * r->frame_bytes);
+      if(pcm == NULL){
+        fprintf(stderr, "Failed allocating memory\n");
+        return false;
+      }
+      seg->pcm = pcm;
+      seg->cap = cap;
+    }
+    size_t count = render_block(mod, block, &seg->pcm[seg->frames * r->frame_bytes]);
+    if(count == 0){
+      seg->last = true;
+      break;
+    }
+    seg->frames += count;
+  }
+  seg->last |= last;
+  return true;
+}
+
+static void *segment_worker(void *arg){
+  segment_renderer *r = arg;
+  openmpt_module *mod = segment_module(r);
+  void *scratch = malloc(r->opt.buffersize * r->frame_bytes);
+  pthread_mutex_lock(&r->lock);
+  if(mod == NULL || scratch == NULL){
+    r->failed = true;
+    pthread_cond_broadcast(&r->cond);
+  }
+  while(!r->failed && !r->stop){
+    // Stay within the window so memory doesn't grow with the song
+    if(r->next < r->count && r->next >= r->read + r->window){
+      pthread_cond_wait(&r->cond, &r->lock);
+      continue;
+    }
+    if(r->next >= r->count){
+      break;
+    }
+    size_t i = r->next ++;
+    pthread_mutex_unlock(&r->lock);
+    bool ok = render_segment(r, mod, i, scratch);
+    pthread_mutex_lock(&r->lock);
+    r->segments[i].state = ok ? SEGMENT_DONE : SEGMENT_FAILED;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->lock);
+  free(scratch);
+  if(mod != NULL){
+    openmpt_module_destroy(mod);
+  }
+  return NULL;
+}
+
+/* Splits the song into segments of opt.segment_length seconds and starts
+ * rendering them on opt.jobs threads.
+ * param file module contents, kept until segments_finish
+ * param duration length of the song in seconds
+ * return false if the renderer could not be set up
+ */
+bool segments_start(segment_renderer *r, const modopus_file *file, const char *path, double duration, const modopus_settings opt){
+  memset(r, 0, sizeof(*r));
+  r->file = file;
+  r->path = path;
+  r->opt = opt;
+  r->frame_bytes = sample_bytes(opt) * opt.channels;
+  r->length = (size_t)(opt.segment_length * opt.samplerate);
+  if(r->length < opt.buffersize){
+    r->length = opt.buffersize;
+  }
+  double frames = ceil(duration * opt.samplerate);
+  r->count = frames > r->length ? (size_t)ceil(frames / r->length) : 1;
+  r->nthreads = opt.jobs > 1 ? (size_t)opt.jobs : 1;
+  if(r->nthreads > r->count){
+    r->nthreads = r->count;
+  }
+  r->window = r->nthreads * 2;
+  r->diff_peak = 0;
+  r->segments = calloc(r->count, sizeof(segment));
+  r->threads = calloc(r->nthreads, sizeof(pthread_t));
+  if(opt.verify_segments){
+    r->serial = segment_module(r);
+    r->check = malloc(opt.buffersize * r->frame_bytes);
+  }
+  if(r->segments == NULL || r->threads == NULL || (opt.verify_segments && (r->serial == NULL || r->check == NULL))){
+    fprintf(stderr, "Failed allocating memory\n");
+    free(r->segments);
+    free(r->threads);
+    free(r->check);
+    if(r->serial != NULL){
+      openmpt_module_destroy(r->serial);
+    }
+    return false;
+  }
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  size_t started = 0;
+  for(; started < r->nthreads; started ++){
+    if(pthread_create(&r->threads[started], NULL, segment_worker, r) != 0){
+      break;
+    }
+  }
+  if(started == 0){
+    fprintf(stderr, "Failed creating segment threads\n");
+    r->nthreads = 0;
+    segments_finish(r, NULL);
+    return false;
+  }
+  r->nthreads = started;
+  return true;
+}
+
+// Sample i of interleaved pcm as a float
+static double sample_at(const void *pcm, const modopus_settings opt, size_t i){
+  if(opt.sample_format == MODOPUS_S16){
+    return ((const int16_t *)pcm)[i] / 32768.0;
+  }
+  return ((const float *)pcm)[i];
+}
+
+// Compares frames read from the segments with the serial render
+static void verify_block(segment_renderer *r, const modopus_settings opt, const void *buffer, size_t count){
+  modopus_settings block = opt;
+  block.buffersize = count;
+  size_t serial = render_block(r->serial, block, r->check);
+  r->serial_frames += serial;
+  for(size_t i = 0; i < serial * opt.channels; i ++){
+    double a = sample_at(buffer, opt, i);
+    double d = a - sample_at(r->check, opt, i);
+    r->signal_energy += a * a;
+    r->diff_energy += d * d;
+    if(fabs(d) > r->diff_peak){
+      r->diff_peak = fabs(d);
+      r->diff_frame = r->frames + i / opt.channels;
+    }
+  }
+}
+
+/* Reads the next block of the song, waiting for its segment if needed.
+ * param buffer room for opt.buffersize * opt.channels samples
+ * return frames read, 0 at the end of the song or if rendering failed
+ */
+size_t segments_read(segment_renderer *r, const modopus_settings opt, void *buffer){
+  pthread_mutex_lock(&r->lock);
+  segment *seg = NULL;
+  while(!r->ended){
+    seg = &r->segments[r->read];
+    if(seg->state == SEGMENT_QUEUED && !r->failed){
+      pthread_cond_wait(&r->cond, &r->lock);
+      continue;
+    }
+    if(seg->state != SEGMENT_DONE){
+      r->failed = true;
+      r->ended = true;
+    }
+    else if(r->read_pos < seg->frames){
+      break;
+    }
+    else if(seg->last){
+      r->ended = true;
+    }
+    else{
+      // Done with this segment, its worker can move on
+      free(seg->pcm);
+      seg->pcm = NULL;
+      r->read ++;
+      r->read_pos = 0;
+      pthread_cond_broadcast(&r->cond);
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+  if(r->ended){
+    return 0;
+  }
+  // Only the reader touches a finished segment
+  size_t count = seg->frames - r->read_pos;
+  if(count > opt.buffersize){
+    count = opt.buffersize;
+  }
+  memcpy(buffer, &seg->pcm[r->read_pos * r->frame_bytes], count * r->frame_bytes);
+  r->read_pos += count;
+  if(r->serial != NULL){
+    verify_block(r, opt, buffer, count);
+  }
+  r->frames += count;
+  return count;
+}
+
+/* Stops the workers and frees the segments.
+ * param out receives the --verify-segments report, NULL for none
+ * return false if a segment failed to render
+ */
+bool segments_finish(segment_renderer *r, FILE *out){
+  pthread_mutex_lock(&r->lock);
+  r->stop = true;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  for(size_t i = 0; i < r->nthreads; i ++){
+    pthread_join(r->threads[i], NULL);
+  }
+  bool ok = !r->failed;
+  if(r->serial != NULL){
+    // Whatever the serial render has left makes it longer
+    if(r->ended && ok){
+      size_t count;
+      while((count = render_block(r->serial, r->opt, r->check)) > 0){
+        r->serial_frames += count;
+      }
+    }
+    if(out != NULL && ok){
+      long long extra = (long long)r->frames - (long long)r->serial_frames;
+      if(r->diff_peak == 0 && extra == 0){
+        fprintf(out, "Verified:       identical to a serial render\n\n");
+      }
+      else{
+        fprintf(out, "Verified:       %+lld frames against a serial render\n", extra);
+        if(r->diff_peak > 0){
+          fprintf(out, "                peak difference %.1f dBFS at %.3f s, %.1f dB below the signal\n",
+              20 * log10(r->diff_peak), (double)r->diff_frame / r->opt.samplerate,
+              10 * log10(r->signal_energy / r->diff_energy));
+        }
+        fprintf(out, "\n");
+      }
+    }
+    openmpt_module_destroy(r->serial);
+  }
+  for(size_t i = 0; i < r->count; i ++){
+    free(r->segments[i].pcm);
+  }
+  free(r->segments);
+  free(r->threads);
+  free(r->check);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  return ok;
+}
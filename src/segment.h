@@ -0,0 +1,60 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <libopenmpt/libopenmpt.h>
+
+#include "modopus.h"
+#include "mapfile.h"
+
+// Part of the song rendered by one worker
+typedef struct{
+  unsigned char *pcm;
+  size_t frames;
+  size_t cap;
+  int state;       // SEGMENT_QUEUED, SEGMENT_DONE or SEGMENT_FAILED
+  bool last;       // the song ended inside this segment
+}segment;
+
+/* Renders a song in segments on opt.jobs threads, see --segments.
+ * Every worker has its own module instance, seeks to a little before its
+ * segment and renders the pre-roll away so the mixer and effects settle.
+ * The segments are read back in order with segments_read.
+ */
+typedef struct segment_renderer{
+  const modopus_file *file;
+  const char *path;
+  modopus_settings opt;
+  size_t frame_bytes;
+  size_t length;     // frames per segment, the last one runs to the end
+  size_t count;
+  size_t window;     // segments rendered ahead of the reader at most
+  segment *segments;
+  size_t next;       // next segment for a worker
+  size_t read;       // segment being read
+  size_t read_pos;   // frames of it already read
+  bool failed;
+  bool stop;
+  bool ended;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t *threads;
+  size_t nthreads;
+  // --verify-segments renders the song serially alongside and compares
+  openmpt_module *serial;
+  unsigned char *check;
+  uint64_t frames;         // frames read
+  uint64_t serial_frames;  // frames of the serial render
+  double diff_peak;
+  uint64_t diff_frame;     // frame of the largest difference
+  double diff_energy;
+  double signal_energy;
+}segment_renderer;
+
+bool segments_start(segment_renderer *, const modopus_file *, const char *, double, const modopus_settings);
+size_t segments_read(segment_renderer *, const modopus_settings, void *);
+bool segments_finish(segment_renderer *, FILE *);
+#endif
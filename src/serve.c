@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "modopus.h"
+#include "batch.h"
+#include "options.h"
+#include "stats.h"
+#include "serve.h"
+
+/* Conversion daemon on a local unix socket.
+ * Each request is one line of tab separated fields:
+ *   <input path> TAB <output path> [TAB <setting>[=<value>]]...
+ * An empty output path is derived from the input like on the command line.
+ * Settings are long option names, e.g. "interpolation=8" or "auto-comment".
+ * Each request gets one line back, "ok <stats json>" or "error <reason>".
+ * A connection may send any number of requests.
+ */
+
+// State shared between the server threads
+typedef struct{
+  int listen_fd;
+  pthread_mutex_t log_lock;
+  modopus_settings opt;
+}server_state;
+
+static const char *socket_path = NULL;
+
+static void handle_signal(int sig){
+  (void)sig;
+  unlink(socket_path);
+  _exit(EXIT_SUCCESS);
+}
+
+/* Runs a single request line and writes the reply.
+ * return false if the reply could not be sent
+ */
+static bool handle_request(server_state *server, char *line, FILE *reply){
+  char *input = strsep(&line, "\t");
+  char *output = strsep(&line, "\t");
+  if(input == NULL || strcmp(input, "") == 0 || output == NULL){
+    fprintf(reply, "error expected <input>\\t<output>\n");
+    return fflush(reply) == 0;
+  }
+
+  modopus_settings opt = server->opt;
+  // Rejections are sent to the client instead of the server's own output
+  char *msg = NULL;
+  size_t msglen = 0;
+  FILE *msgout = open_memstream(&msg, &msglen);
+  if(msgout == NULL){
+    fprintf(reply, "error out of memory\n");
+    return fflush(reply) == 0;
+  }
+  int error = 0;
+  char *name = NULL;
+  char *field;
+  while(error == 0 && (field = strsep(&line, "\t")) != NULL){
+    if(strcmp(field, "") == 0){
+      continue;
+    }
+    name = strsep(&field, "=");
+    error = set_option(&opt, name, field, msgout);
+  }
+  if(error == 0){
+    calc_buffer(&opt);
+    error = validate_settings(&opt, msgout) ? 0 : 1;
+  }
+  fclose(msgout);
+  if(error != 0){
+    // One line per reply, the message loses its line breaks
+    for(char *p = msg; p != NULL && *p != '\0'; p ++){
+      if(*p == '\n'){
+        *p = msglen > 0 && p == &msg[msglen - 1] ? '\0' : ' ';
+      }
+    }
+    if(msg != NULL && strcmp(msg, "") != 0){
+      fprintf(reply, "error %s\n", msg);
+    }
+    else{
+      fprintf(reply, "error %s setting %s\n", error > 0 ? "invalid value for" : "unknown", name);
+    }
+    free(msg);
+    return fflush(reply) == 0;
+  }
+  free(msg);
+
+  // Console output of the conversion isn't sent to the client
+  char *log = NULL;
+  size_t loglen = 0;
+  FILE *out = open_memstream(&log, &loglen);
+  if(out == NULL){
+    fprintf(reply, "error out of memory\n");
+    return fflush(reply) == 0;
+  }
+  modopus_stats stats = {0};
+  bool ok = convert_file(input, strcmp(output, "") == 0 ? NULL : output, opt, out, &stats, NULL) == 0;
+  fclose(out);
+  free(log);
+
+  if(!server->opt.quiet){
+    pthread_mutex_lock(&server->log_lock);
+    printf("%s -> %s: %s\n", input, strcmp(output, "") == 0 ? "(default)" : output, ok ? "ok" : "failed");
+    fflush(stdout);
+    pthread_mutex_unlock(&server->log_lock);
+  }
+  if(ok){
+    fprintf(reply, "ok ");
+    print_stats_json(reply, input, &stats, opt, ok);
+  }
+  else{
+    fprintf(reply, "error failed converting %s\n", input);
+  }
+  return fflush(reply) == 0;
+}
+
+static void handle_connection(server_state *server, int fd){
+  int readfd = dup(fd);
+  FILE *in = readfd < 0 ? NULL : fdopen(readfd, "r");
+  FILE *reply = fdopen(fd, "w");
+  if(in == NULL || reply == NULL){
+    fprintf(stderr, "Failed opening connection: %s\n", strerror(errno));
+    if(in != NULL)
+      fclose(in);
+    else if(readfd >= 0)
+      close(readfd);
+    if(reply != NULL)
+      fclose(reply);
+    else
+      close(fd);
+    return;
+  }
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t n;
+  while((n = getline(&line, &len, in)) > 0){
+    while(n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')){
+      line[-- n] = '\0';
+    }
+    if(n == 0){
+      continue;
+    }
+    if(!handle_request(server, line, reply)){
+      break;
+    }
+  }
+  free(line);
+  fclose(in);
+  fclose(reply);
+}
+
+// Every worker accepts connections on its own, state stays warm between jobs
+static void *server_worker(void *arg){
+  server_state *server = arg;
+  while(1){
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if(fd < 0){
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "%s: accept failed: %s\n", socket_path, strerror(errno));
+      break;
+    }
+    handle_connection(server, fd);
+  }
+  return NULL;
+}
+
+/* Listens on a unix socket at path and converts requests until killed.
+ * Up to opt.jobs connections are served at the same time.
+ * param path socket path, a stale socket there is replaced
+ * param opt default settings for every request
+ * return 1 if the socket could not be set up
+ */
+int serve(const char *path, const modopus_settings opt){
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)){
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  server_state server;
+  server.opt = opt;
+  server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(server.listen_fd < 0){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  // Replace a socket left behind by an earlier server, but nothing else
+  struct stat st;
+  if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)){
+    unlink(path);
+  }
+  // Only our own user may connect, requests read and write files as us
+  mode_t mask = umask(0077);
+  int bound = bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if(bound != 0 || chmod(path, 0600) != 0 || listen(server.listen_fd, 64) != 0){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    close(server.listen_fd);
+    return 1;
+  }
+  socket_path = path;
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGPIPE, SIG_IGN);
+  pthread_mutex_init(&server.log_lock, NULL);
+  if(!opt.quiet){
+    printf("Listening on %s with %d worker(s)\n", path, opt.jobs);
+    fflush(stdout);
+  }
+
+  size_t nthreads = opt.jobs > 1 ? (size_t)opt.jobs - 1 : 0;
+  pthread_t threads[nthreads > 0 ? nthreads : 1];
+  size_t started = 0;
+  for(; started < nthreads; started ++){
+    if(pthread_create(&threads[started], NULL, server_worker, &server) != 0){
+      fprintf(stderr, "Failed creating worker thread, continuing with %zu\n", started + 1);
+      break;
+    }
+  }
+  server_worker(&server);
+  for(size_t i = 0; i < started; i ++){
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&server.log_lock);
+  close(server.listen_fd);
+  unlink(path);
+  return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef SERVE_H
+#define SERVE_H
+#include "modopus.h"
+
+int serve(const char *, const modopus_settings);
+#endif
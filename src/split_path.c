@@ -17,6 +17,65 @@ char *parse_filename(char **split_path){
   return out;
 }
 
+/* Places filename inside dir.
+ * param dir directory, NULL or "" for the current directory
+ * param filename name of the file
+ * return "dir/filename" in a new string, NULL on failure
+ */
+char *join_path(const char *dir, const char *filename){
+  if(filename == NULL){
+    return NULL;
+  }
+  if(dir == NULL || strcmp(dir, "") == 0){
+    return strdup(filename);
+  }
+  size_t dirlen = strlen(dir);
+  bool slash = dir[dirlen - 1] == '/';
+  size_t outlen = dirlen + !slash + strlen(filename);
+  if(outlen > PATH_MAX){
+    fprintf(stderr, "Path too long\n");
+    return NULL;
+  }
+  char *out = calloc(outlen + 1, sizeof(char));
+  if(out == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return NULL;
+  }
+  strcat(out, dir);
+  if(!slash){
+    strcat(out, "/");
+  }
+  strcat(out, filename);
+  return out;
+}
+
+/* Adds suffix to the name of a file, before its extension.
+ * param path path to file, such as "dir/song.opus"
+ * param suffix text to add, such as "-hi"
+ * return "dir/song-hi.opus" in a new string, NULL on failure
+ */
+char *suffix_path(const char *path, const char *suffix){
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(path, '.');
+  if(dot == NULL || (slash != NULL && dot < slash)){
+    dot = &path[strlen(path)];
+  }
+  size_t outlen = strlen(path) + strlen(suffix);
+  if(outlen > PATH_MAX){
+    fprintf(stderr, "Path too long\n");
+    return NULL;
+  }
+  char *out = calloc(outlen + 1, sizeof(char));
+  if(out == NULL){
+    fprintf(stderr, "Failed allocating memory\n");
+    return NULL;
+  }
+  strncat(out, path, dot - path);
+  strcat(out, suffix);
+  strcat(out, dot);
+  return out;
+}
+
 /* Creates a string array with dir, basename, ext including '.' and '/'
  * param path the path to file being checked
  * return an array of size 3, containing dir, basename, and ext in order. 
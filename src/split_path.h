@@ -3,6 +3,8 @@
 #include <stdlib.h>
 
 char *parse_filename(char **);
+char *join_path(const char *, const char *);
+char *suffix_path(const char *, const char *);
 char **split_path(const char *);
 void free_split_path(char **, size_t);
 
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "modopus.h"
+#include "stats.h"
+
+double monotonic_seconds(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Peak resident set size of the whole process in kB
+long peak_rss_kb(void){
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0){
+    return -1;
+  }
+  return usage.ru_maxrss;
+}
+
+// Writes str as a quoted JSON string
+void json_string(FILE *out, const char *str){
+  fputc('"', out);
+  for(const unsigned char *p = (const unsigned char *)str; *p != '\0'; p ++){
+    if(*p == '"' || *p == '\\'){
+      fprintf(out, "\\%c", *p);
+    }
+    else if(*p < 0x20){
+      fprintf(out, "\\u%04x", *p);
+    }
+    else{
+      fputc(*p, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/* Prints the stats of one file as a single JSON line.
+ * param path input file
+ * param ok whether the conversion succeeded
+ */
+void print_stats_json(FILE *out, const char *path, const modopus_stats *stats, const modopus_settings opt, bool ok){
+  double duration = (double)stats->frames / opt.samplerate;
+  fprintf(out, "{\"file\":");
+  json_string(out, path);
+  fprintf(out, ",\"status\":\"%s\"", ok ? "ok" : "failed");
+  fprintf(out, ",\"load_s\":%.6f,\"render_s\":%.6f,\"encode_s\":%.6f,\"wall_s\":%.6f",
+      stats->load_time, stats->render_time, stats->encode_time, stats->wall_time);
+  fprintf(out, ",\"input_bytes\":%" PRIu64 ",\"output_bytes\":%" PRIu64,
+      stats->input_bytes, stats->output_bytes);
+  if(stats->output_approx){
+    fprintf(out, ",\"output_bytes_approx\":true");
+  }
+  if(opt.live){
+    fprintf(out, ",\"first_audio_s\":%.6f,\"latency_avg_s\":%.6f,\"latency_max_s\":%.6f",
+        stats->first_audio, stats->latency_avg, stats->latency_max);
+  }
+  fprintf(out, ",\"frames\":%" PRIu64 ",\"duration_s\":%.3f,\"realtime_factor\":%.2f,\"peak_rss_kb\":%ld}\n",
+      (uint64_t)stats->frames, duration, stats->wall_time > 0 ? duration / stats->wall_time : 0, peak_rss_kb());
+  fflush(out);
+}
+
+void add_totals(modopus_totals *totals, const modopus_stats *stats, const modopus_settings opt, bool ok){
+  totals->files ++;
+  if(!ok){
+    totals->failed ++;
+  }
+  totals->duration += (double)stats->frames / opt.samplerate;
+  totals->input_bytes += stats->input_bytes;
+  totals->output_bytes += stats->output_bytes;
+}
+
+/* Prints the batch summary as a single JSON line.
+ * The realtime factor is against wall clock time, so it includes the
+ * speedup from parallel jobs.
+ */
+void print_totals_json(FILE *out, const modopus_totals *totals){
+  double wall = monotonic_seconds() - totals->start;
+  fprintf(out, "{\"summary\":true,\"files\":%zu,\"failed\":%zu,\"skipped\":%zu",
+      totals->files, totals->failed, totals->skipped);
+  fprintf(out, ",\"wall_s\":%.6f,\"duration_s\":%.3f", wall, totals->duration);
+  fprintf(out, ",\"input_bytes\":%" PRIu64 ",\"output_bytes\":%" PRIu64,
+      totals->input_bytes, totals->output_bytes);
+  fprintf(out, ",\"realtime_factor\":%.2f,\"peak_rss_kb\":%ld}\n",
+      wall > 0 ? totals->duration / wall : 0, peak_rss_kb());
+  fflush(out);
+}
@@ -0,0 +1,25 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "modopus.h"
+
+// Totals over every file of a batch
+typedef struct{
+  size_t files;
+  size_t failed;
+  size_t skipped;
+  double start;
+  double duration;
+  uint64_t input_bytes;
+  uint64_t output_bytes;
+}modopus_totals;
+
+double monotonic_seconds(void);
+long peak_rss_kb(void);
+void json_string(FILE *, const char *);
+void print_stats_json(FILE *, const char *, const modopus_stats *, const modopus_settings, bool);
+void add_totals(modopus_totals *, const modopus_stats *, const modopus_settings, bool);
+void print_totals_json(FILE *, const modopus_totals *);
+#endif